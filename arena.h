@@ -0,0 +1,156 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Bump-pointer allocator. The memory is mapped in chunks directly from the
+ * kernel, so that the threads filling their arenas don't contend on the
+ * malloc locks, and it is only released all at once by arena_release().
+ */
+#define ARENA_ALIGN (16u)
+#define ARENA_MIN_CHUNK (16u << 10)
+#define ARENA_MAX_CHUNK (1u << 20)
+
+struct arena_chunk
+{
+	struct arena_chunk *next;
+	size_t size, used;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena
+{
+	struct arena_chunk *chunks; /* the first one is being filled */
+	size_t mapped;
+};
+
+#define ARENA_INITIALIZER { .chunks = NULL, .mapped = 0 }
+
+static inline void arena_init(struct arena *a)
+{
+	a->chunks = NULL;
+	a->mapped = 0;
+}
+
+static inline size_t arena_size(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static inline struct arena_chunk *arena_new_chunk(struct arena *a, size_t size)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	size_t csize = a->chunks ? a->chunks->size * 2 : ARENA_MIN_CHUNK;
+	struct arena_chunk *c;
+	int big;
+
+	if (csize > ARENA_MAX_CHUNK)
+		csize = ARENA_MAX_CHUNK;
+	/* big allocations get a chunk for themselves */
+	big = size > csize / 2;
+	if (big)
+		csize = size + sizeof(*c);
+	csize = (csize + page - 1) & ~(page - 1);
+	c = mmap(NULL, csize, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (c == MAP_FAILED)
+		return NULL;
+	a->mapped += csize;
+	c->size = csize - sizeof(*c);
+	c->used = 0;
+	if (big && a->chunks) {
+		/* keep filling the current chunk */
+		c->next = a->chunks->next;
+		a->chunks->next = c;
+	} else {
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+	return c;
+}
+
+static inline void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *c = a->chunks;
+	void *p;
+
+	size = arena_size(size);
+	if (!c || c->size - c->used < size) {
+		c = arena_new_chunk(a, size);
+		if (!c)
+			return NULL;
+	}
+	p = c->data + c->used;
+	c->used += size;
+	return p;
+}
+
+/* Give back the memory, if it was the last allocation */
+static inline void arena_unalloc(struct arena *a, void *p, size_t size)
+{
+	struct arena_chunk *c = a->chunks;
+
+	size = arena_size(size);
+	if (c && c->used >= size && c->data + c->used - size == (char *)p)
+		c->used -= size;
+}
+
+static inline char *arena_strdup(struct arena *a, const char *s)
+{
+	size_t l = strlen(s) + 1;
+	char *p = arena_alloc(a, l);
+
+	if (p)
+		memcpy(p, s, l);
+	return p;
+}
+
+static inline void arena_release(struct arena *a)
+{
+	while (a->chunks) {
+		struct arena_chunk *c = a->chunks;
+
+		a->chunks = c->next;
+		munmap(c, c->size + sizeof(*c));
+	}
+	a->mapped = 0;
+}
+
+/* Moves the allocations of src to dst, which keeps filling its chunk */
+static inline void arena_merge(struct arena *dst, struct arena *src)
+{
+	struct arena_chunk *c = src->chunks;
+
+	if (!c)
+		return;
+	while (c->next)
+		c = c->next;
+	if (dst->chunks) {
+		c->next = dst->chunks->next;
+		dst->chunks->next = src->chunks;
+	} else
+		dst->chunks = src->chunks;
+	dst->mapped += src->mapped;
+	arena_init(src);
+}
+
+/* Forget all the allocations, keeping the current chunk for reuse */
+static inline void arena_reset(struct arena *a)
+{
+	struct arena_chunk *c = a->chunks;
+
+	if (!c)
+		return;
+	a->chunks = c->next;
+	arena_release(a);
+	c->next = NULL;
+	c->used = 0;
+	a->chunks = c;
+	a->mapped = c->size + sizeof(*c);
+}
+
+#endif /* _ARENA_H_ */
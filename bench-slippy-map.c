@@ -0,0 +1,79 @@
+/*
+ * Times merc_project(), and each of its clones, against long2mercx() and
+ * lat2mercy() on random points, see "make bench".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "tstime.h"
+/* for its clones of merc_project(), which are local to it */
+#include "slippy-map.c"
+
+#define BENCH_POINTS (4 << 20)
+#define BENCH_RUNS (5)
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+void merc_project_avx2(struct merc *m, const double *latlon, int n)
+	__asm__("merc_project.avx2");
+void merc_project_default(struct merc *m, const double *latlon, int n)
+	__asm__("merc_project.default");
+#endif
+
+static void project_scalar(struct merc *m, const double *latlon, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		m[i].x = long2mercx(latlon[2 * i + 1]);
+		m[i].y = lat2mercy(latlon[2 * i]);
+	}
+}
+
+/* the best of BENCH_RUNS */
+static void bench(const char *name,
+		  void (*project)(struct merc *m, const double *latlon, int n),
+		  struct merc *m, const double *latlon, int n)
+{
+	struct timespec start, end, d, best = { .tv_sec = 1000 };
+	uint32_t sum = 0;
+	int run, i;
+
+	for (run = 0; run < BENCH_RUNS; ++run) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		project(m, latlon, n);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		d = timespec_sub(end, start);
+		if (timespec_compare(&d, &best) < 0)
+			best = d;
+	}
+	for (i = 0; i < n; ++i)
+		sum += m[i].x ^ m[i].y;
+	printf("%-14s %d points in %ld.%06ld s, %.2f ns each (%08x)\n", name, n,
+	       best.tv_sec, best.tv_nsec / 1000,
+	       (best.tv_sec * 1e9 + best.tv_nsec) / n, sum);
+}
+
+int main(void)
+{
+	const int n = BENCH_POINTS;
+	double *latlon = malloc(2 * n * sizeof(*latlon));
+	struct merc *m = malloc(n * sizeof(*m));
+	int i;
+
+	srand48(1);
+	for (i = 0; i < n; ++i) {
+		latlon[2 * i] = (2.0 * drand48() - 1.0) * MERC_MAX_LAT;
+		latlon[2 * i + 1] = 360.0 * drand48() - 180.0;
+	}
+	bench("scalar", project_scalar, m, latlon, n);
+	bench("merc_project", merc_project, m, latlon, n);
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		bench("avx2", merc_project_avx2, m, latlon, n);
+	bench("default", merc_project_default, m, latlon, n);
+#endif
+	free(m);
+	free(latlon);
+	return 0;
+}
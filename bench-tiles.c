@@ -0,0 +1,134 @@
+/*
+ * Times the insertions and the lookups of the tiles of a zoom level, with
+ * and without the fast path of find_tile() on the last tile found, see
+ * "make bench".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "tstime.h"
+
+/* for its static tables of tiles */
+#define main gpx2tiles_main
+#include "gpx2tiles.c"
+#undef main
+
+#define BENCH_ZOOM (18)
+#define BENCH_LOOKUPS (4 << 20)
+/* the points of a track in a tile, before it goes to the next one */
+#define BENCH_TRACK_RUN (8)
+
+static double elapsed(const struct timespec *start)
+{
+	struct timespec end, d;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	d = timespec_sub(end, *start);
+	return d.tv_sec + d.tv_nsec * 1e-9;
+}
+
+/* the tiles are a square of side by side tiles, as drawn by the tracks */
+static struct xy grid_xy(int side, int i)
+{
+	struct xy xy = { .x = 1000 + i % side, .y = 2000 + i / side };
+
+	return xy;
+}
+
+/* from tile to neighbouring tile, BENCH_TRACK_RUN lookups on each */
+static void track_walk(struct xy *xy, int n, int side)
+{
+	int i, x = side / 2, y = side / 2;
+
+	for (i = 0; i < n; ++i) {
+		if (i % BENCH_TRACK_RUN == 0) {
+			x += (int)(lrand48() % 3) - 1;
+			y += (int)(lrand48() % 3) - 1;
+			x = x < 0 ? 0 : x >= side ? side - 1 : x;
+			y = y < 0 ? 0 : y >= side ? side - 1 : y;
+		}
+		xy[i] = grid_xy(side, y * side + x);
+	}
+}
+
+static void random_walk(struct xy *xy, int n, int side)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		xy[i] = grid_xy(side, lrand48() % (side * side));
+}
+
+static void bench_lookups(const char *name, const struct xy *xy, int n,
+			  int fast_path)
+{
+	struct zoom_level *zl = zoom_levels + BENCH_ZOOM;
+	unsigned long lookups = zl->lookups, probes = zl->probes;
+	struct timespec start;
+	int i, missed = 0;
+	double t;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < n; ++i) {
+		if (!fast_path)
+			zl->last = NULL;
+		missed += !find_tile(xy + i, BENCH_ZOOM);
+	}
+	t = elapsed(&start);
+	lookups = zl->lookups - lookups;
+	probes = zl->probes - probes;
+	printf("  %-6s %-9s %6.2f ns per lookup, %4.1f%% hashed, %.2f probes%s\n",
+	       name, fast_path ? "fast path" : "hashed", t * 1e9 / n,
+	       100.0 * lookups / n, lookups ? (double)probes / lookups : 0.0,
+	       missed ? ", missed" : "");
+}
+
+static void bench_tiles(int tile_cnt, struct xy *xy)
+{
+	struct zoom_level *zl;
+	struct timespec start;
+	struct tile *tile;
+	unsigned i;
+	int side = 1;
+	double t;
+
+	/* the lookups are on the full rows only */
+	while ((side + 1) * (side + 1) <= tile_cnt)
+		side++;
+	prepare_zoom_levels();
+	zl = zoom_levels + BENCH_ZOOM;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < (unsigned)tile_cnt; ++i) {
+		struct xy at = grid_xy(side, i);
+
+		alloc_tile(&at, BENCH_ZOOM);
+	}
+	t = elapsed(&start);
+	printf("%d tiles: %.2f ns per insertion, table of %u\n", tile_cnt,
+	       t * 1e9 / tile_cnt, zoom_level_size(zl));
+	track_walk(xy, BENCH_LOOKUPS, side);
+	bench_lookups("track", xy, BENCH_LOOKUPS, 1);
+	bench_lookups("track", xy, BENCH_LOOKUPS, 0);
+	random_walk(xy, BENCH_LOOKUPS, side);
+	bench_lookups("random", xy, BENCH_LOOKUPS, 1);
+	bench_lookups("random", xy, BENCH_LOOKUPS, 0);
+	zoom_level_for_each(tile, zl, i)
+		free(tile);
+	free(zl->tiles);
+	zl->tiles = NULL;
+}
+
+int main(void)
+{
+	static const int tile_cnts[] = { 100000, 300000, 1000000 };
+	struct xy *xy = malloc(BENCH_LOOKUPS * sizeof(*xy));
+	unsigned i;
+
+	zoom_min = zoom_max = BENCH_ZOOM;
+	srand48(1);
+	for (i = 0; i < sizeof(tile_cnts) / sizeof(tile_cnts[0]); ++i)
+		bench_tiles(tile_cnts[i], xy);
+	free(zoom_levels);
+	free(xy);
+	return 0;
+}
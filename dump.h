@@ -7,32 +7,37 @@ static inline void dump_points(struct gpx_file *f)
 		printf("From %s (%d)\n", f->gpx->path, f->gpx->points_cnt);
 
 		slist_for_each(seg, &f->gpx->segments) {
-			const struct gpx_point *pt;
+			int i;
 
-			slist_for_each(pt, &seg->points) {
+			for (i = 0; i < seg->points_cnt; ++i) {
+				const unsigned flags = seg->flags[i];
+				char time[32] = "";
+
+				if (flags & GPX_PT_TIME)
+					gpx_format_time(time, sizeof(time), seg->time[i]);
 				printf(" %d (%s): %f,%f %s\n",
-				       nseg, seg->src, pt->loc.lat, pt->loc.lon, pt->time);
+				       nseg, seg->src, seg->loc[i].lat, seg->loc[i].lon, time);
 				int z, len = 0;
 				for (z = 1; z <= 18; ++z) {
-					struct xy tile = get_tile_xy(&pt->loc, z);
+					struct xy tile = get_tile_xy(&seg->merc[i], z);
 					len += printf(" %d/%d/%d", z, tile.x, tile.y);
 					if (len >= 60) {
 						fputc('\n', stdout);
 						len = 0;
 					}
 				}
-				if (pt->flags & GPX_PT_ELE)
-					printf("  ele %f\n", pt->ele);
-				if (pt->flags & GPX_PT_SPEED)
-					printf("  spd %f\n", pt->speed);
-				if (pt->flags & (GPX_PT_HDOP|GPX_PT_VDOP|GPX_PT_PDOP)) {
+				if (flags & GPX_PT_ELE)
+					printf("  ele %f\n", seg->ele[i]);
+				if (flags & GPX_PT_SPEED)
+					printf("  spd %f\n", seg->speed[i]);
+				if (flags & (GPX_PT_HDOP|GPX_PT_VDOP|GPX_PT_PDOP)) {
 					fputc(' ', stdout);
-					if (pt->flags & GPX_PT_HDOP)
-						printf(" hdop %f", pt->hdop);
-					if (pt->flags & GPX_PT_VDOP)
-						printf(" vdop %f", pt->vdop);
-					if (pt->flags & GPX_PT_PDOP)
-						printf(" pdop %f", pt->pdop);
+					if (flags & GPX_PT_HDOP)
+						printf(" hdop %f", seg->hdop[i]);
+					if (flags & GPX_PT_VDOP)
+						printf(" vdop %f", seg->vdop[i]);
+					if (flags & GPX_PT_PDOP)
+						printf(" pdop %f", seg->pdop[i]);
 					fputc('\n', stdout);
 				}
 			}
@@ -43,19 +48,17 @@ static inline void dump_points(struct gpx_file *f)
 
 static inline void dump_zoom_level(int z)
 {
-	int len = 0, h;
-
-	for (h = 0; h < ZOOM_TILE_HASH_SIZE; ++h) {
-		struct tile *tile;
+	struct tile *tile;
+	unsigned i;
+	int len = 0;
 
-		slist_for_each(tile, &zoom_levels[z].tiles[h]) {
-			len += printf(" %d/%d (%d)",
-				      tile->xy.x, tile->xy.y,
-				      tile->point_cnt);
-			if (len >= 60) {
-				fputc('\n', stdout);
-				len = 0;
-			}
+	zoom_level_for_each(tile, zoom_levels + z, i) {
+		len += printf(" %d/%d (%d)",
+			      tile->xy.x, tile->xy.y,
+			      tile->point_cnt);
+		if (len >= 60) {
+			fputc('\n', stdout);
+			len = 0;
 		}
 	}
 	if (len)
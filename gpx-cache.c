@@ -0,0 +1,333 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "slist.h"
+#include "gpx.h"
+#include "gpx-cache.h"
+
+#define countof(a) (sizeof(a) / sizeof((a)[0]))
+
+const char *gpx_cache_dir;
+
+/*
+ * A cache file holds the segments of one GPX file as they are after the
+ * parsing (deduplicated, with synthesized speed), so that their columns can
+ * be used directly from the mapped file. Every part of it is aligned to
+ * GPX_CACHE_ALIGN:
+ *
+ *   struct gpx_cache_header, path of the GPX file,
+ *   segments_cnt times: struct gpx_cache_segment, src, the columns
+ *
+ * The waypoints are the last segment, if has_wpts. The version must be
+ * increased with any change of the layout or of what the parser produces.
+ */
+#define GPX_CACHE_MAGIC "gpx2tlc\n"
+#define GPX_CACHE_VERSION (5u)
+#define GPX_CACHE_BYTE_ORDER (0x01020304u)
+#define GPX_CACHE_ALIGN (16u)
+
+struct gpx_cache_header
+{
+	char magic[8];
+	uint32_t version, byte_order;
+	/* of the GPX file */
+	uint64_t size;
+	int64_t mtime_sec, mtime_nsec;
+	uint32_t path_len;
+
+	int32_t points_cnt, track_cnt;
+	uint32_t segments_cnt, has_wpts;
+	char time[24];
+};
+
+struct gpx_cache_segment
+{
+	uint32_t points_cnt, columns;
+	uint32_t src_len;
+};
+
+/* the columns, in the order they are stored */
+static const struct cache_column
+{
+	size_t offset; /* of the pointer in struct gpx_segment */
+	size_t size;
+	unsigned flag; /* 0 if always present, else only with the flag */
+} cache_columns[] = {
+	{ offsetof(struct gpx_segment, loc), sizeof(struct gpx_latlon), 0 },
+	{ offsetof(struct gpx_segment, merc), sizeof(struct merc), 0 },
+	{ offsetof(struct gpx_segment, time), sizeof(int64_t), GPX_PT_TIME },
+	{ offsetof(struct gpx_segment, flags), sizeof(uint16_t), 0 },
+	{ offsetof(struct gpx_segment, speed), sizeof(float), GPX_PT_SPEED },
+	{ offsetof(struct gpx_segment, ele), sizeof(float), GPX_PT_ELE },
+	{ offsetof(struct gpx_segment, hdop), sizeof(float), GPX_PT_HDOP },
+	{ offsetof(struct gpx_segment, vdop), sizeof(float), GPX_PT_VDOP },
+	{ offsetof(struct gpx_segment, pdop), sizeof(float), GPX_PT_PDOP },
+};
+
+#define column_ptr(seg, c) ((void **)((char *)(seg) + (c)->offset))
+#define column_present(seg, c) (!(c)->flag || ((seg)->columns & (c)->flag))
+
+static size_t cache_align(size_t size)
+{
+	return (size + GPX_CACHE_ALIGN - 1) & ~(size_t)(GPX_CACHE_ALIGN - 1);
+}
+
+/* the name of the cache file of a GPX file is the FNV-1a hash of its path */
+static char *cache_path(const char *real)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	char *path;
+
+	for (; *real; ++real)
+		h = (h ^ (unsigned char)*real) * 0x100000001b3ull;
+	if (asprintf(&path, "%s/%016llx.gpxc", gpx_cache_dir,
+		     (unsigned long long)h) < 0)
+		return NULL;
+	return path;
+}
+
+struct cache_map
+{
+	const char *p;
+	size_t size, off;
+};
+
+static const void *cache_take(struct cache_map *m, size_t size)
+{
+	const char *p = m->p + m->off;
+
+	size = cache_align(size);
+	if (size > m->size - m->off)
+		return NULL;
+	m->off += size;
+	return p;
+}
+
+/* so that the sources can still be compared by their address */
+static const char *cache_src(const char *src)
+{
+	static const char *const known[] = {
+		GPX_SRC_GPS, GPX_SRC_NETWORK, GPX_SRC_WAYPOINT, GPX_SRC_UNKNOWN,
+	};
+	int i;
+
+	for (i = 0; i < (int)countof(known); ++i)
+		if (strcmp(src, known[i]) == 0)
+			return known[i];
+	return src;
+}
+
+static struct gpx_segment *cache_segment(struct cache_map *m, struct arena *arena)
+{
+	const struct gpx_cache_segment *cs = cache_take(m, sizeof(*cs));
+	struct gpx_segment *seg;
+	const char *src;
+	int i;
+
+	if (!cs)
+		return NULL;
+	src = cache_take(m, (size_t)cs->src_len + 1);
+	if (!src || src[cs->src_len] || cs->points_cnt > INT_MAX)
+		return NULL;
+	seg = arena_alloc(arena, sizeof(*seg));
+	seg->next = NULL;
+	seg->src = cache_src(src);
+	seg->points_cnt = cs->points_cnt;
+	seg->columns = cs->columns;
+	seg->bands_cnt = 0;
+	seg->bands = NULL;
+	seg->boxes = NULL;
+	for (i = 0; i < (int)countof(cache_columns); ++i) {
+		const struct cache_column *c = cache_columns + i;
+		const void *p = NULL;
+
+		if (column_present(seg, c)) {
+			p = cache_take(m, c->size * cs->points_cnt);
+			if (!p)
+				return NULL;
+		}
+		*column_ptr(seg, c) = (void *)p;
+	}
+	return seg;
+}
+
+static struct gpx_data *cache_load(const char *cache, const char *path,
+				   const char *real, const struct stat *st)
+{
+	const struct gpx_cache_header *h;
+	struct cache_map m = { 0 };
+	struct gpx_data *gpx;
+	struct stat cst;
+	const char *p;
+	uint32_t i;
+	int fd;
+
+	fd = open(cache, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &cst) < 0 || cst.st_size < (off_t)sizeof(*h)) {
+		close(fd);
+		return NULL;
+	}
+	m.size = cst.st_size;
+	m.p = mmap(NULL, m.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (m.p == MAP_FAILED)
+		return NULL;
+	h = cache_take(&m, sizeof(*h));
+	if (!h || memcmp(h->magic, GPX_CACHE_MAGIC, sizeof(h->magic)) ||
+	    h->version != GPX_CACHE_VERSION ||
+	    h->byte_order != GPX_CACHE_BYTE_ORDER ||
+	    h->size != (uint64_t)st->st_size ||
+	    h->mtime_sec != st->st_mtim.tv_sec ||
+	    h->mtime_nsec != st->st_mtim.tv_nsec ||
+	    h->has_wpts > 1 || h->segments_cnt < h->has_wpts)
+		goto stale;
+	p = cache_take(&m, (size_t)h->path_len + 1);
+	if (!p || p[h->path_len] || strcmp(p, real))
+		goto stale;
+
+	madvise((void *)m.p, m.size, MADV_WILLNEED);
+	gpx = gpx_alloc(path);
+	gpx->map = (void *)m.p;
+	gpx->map_size = m.size;
+	gpx->points_cnt = h->points_cnt;
+	gpx->track_cnt = h->track_cnt;
+	memcpy(gpx->time, h->time, sizeof(gpx->time) - 1);
+	for (i = 0; i < h->segments_cnt; ++i) {
+		struct gpx_segment *seg = cache_segment(&m, &gpx->arena);
+
+		if (!seg) {
+			gpx_free(gpx);
+			return NULL;
+		}
+		if (h->has_wpts && i == h->segments_cnt - 1)
+			gpx->wpts = seg;
+		else
+			put_trk_segment(gpx, seg);
+	}
+	return gpx;
+stale:
+	munmap((void *)m.p, m.size);
+	return NULL;
+}
+
+static int cache_write(FILE *f, const void *p, size_t size)
+{
+	static const char pad[GPX_CACHE_ALIGN];
+	size_t l = cache_align(size) - size;
+
+	if (fwrite(p, 1, size, f) != size || fwrite(pad, 1, l, f) != l)
+		return -1;
+	return 0;
+}
+
+static int cache_write_segment(FILE *f, const struct gpx_segment *seg)
+{
+	struct gpx_cache_segment cs = {
+		.points_cnt = seg->points_cnt,
+		.columns = seg->columns,
+		.src_len = strlen(seg->src),
+	};
+	int i;
+
+	if (cache_write(f, &cs, sizeof(cs)) ||
+	    cache_write(f, seg->src, cs.src_len + 1))
+		return -1;
+	for (i = 0; i < (int)countof(cache_columns); ++i) {
+		const struct cache_column *c = cache_columns + i;
+
+		if (column_present(seg, c) &&
+		    cache_write(f, *column_ptr(seg, c), c->size * seg->points_cnt))
+			return -1;
+	}
+	return 0;
+}
+
+/* written to a temporary file first, for the concurrent readers */
+static void cache_store(const char *cache, const struct gpx_data *gpx,
+			const char *real, const struct stat *st)
+{
+	struct gpx_cache_header h = {
+		.magic = GPX_CACHE_MAGIC,
+		.version = GPX_CACHE_VERSION,
+		.byte_order = GPX_CACHE_BYTE_ORDER,
+		.size = st->st_size,
+		.mtime_sec = st->st_mtim.tv_sec,
+		.mtime_nsec = st->st_mtim.tv_nsec,
+		.path_len = strlen(real),
+		.points_cnt = gpx->points_cnt,
+		.track_cnt = gpx->track_cnt,
+		.has_wpts = !!gpx->wpts,
+	};
+	const struct gpx_segment *seg;
+	char *tmp;
+	FILE *f;
+	int fd, err;
+
+	slist_for_each(seg, &gpx->segments)
+		++h.segments_cnt;
+	h.segments_cnt += h.has_wpts;
+	memcpy(h.time, gpx->time, sizeof(h.time));
+
+	if (asprintf(&tmp, "%s.XXXXXX", cache) < 0)
+		return;
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+	fchmod(fd, 0644);
+	f = fdopen(fd, "w");
+	err = !f || cache_write(f, &h, sizeof(h)) ||
+		cache_write(f, real, h.path_len + 1);
+	if (!err)
+		slist_for_each(seg, &gpx->segments)
+			if ((err = cache_write_segment(f, seg)))
+				break;
+	if (!err && gpx->wpts)
+		err = cache_write_segment(f, gpx->wpts);
+	if (f ? fclose(f) : close(fd))
+		err = 1;
+	if (!err && rename(tmp, cache) < 0)
+		err = 1;
+	if (err) {
+		fprintf(stderr, "%s: %s\n", cache, strerror(errno));
+		unlink(tmp);
+	}
+	free(tmp);
+}
+
+struct gpx_data *gpx_cache_read_file(const char *path)
+{
+	extern int verbose;
+	char *real = realpath(path, NULL);
+	struct gpx_data *gpx;
+	struct stat st;
+	char *cache;
+
+	if (!real || stat(real, &st) < 0 || !(cache = cache_path(real))) {
+		free(real);
+		return gpx_read_file(path);
+	}
+	gpx = cache_load(cache, path, real, &st);
+	if (gpx) {
+		if (verbose > 0)
+			fprintf(stderr, "%s: loaded from %s\n", path, cache);
+	} else {
+		gpx = gpx_read_file(path);
+		cache_store(cache, gpx, real, &st);
+	}
+	free(cache);
+	free(real);
+	return gpx;
+}
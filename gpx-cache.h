@@ -0,0 +1,15 @@
+#ifndef _GPX_CACHE_H_
+#define _GPX_CACHE_H_
+
+#include "gpx.h"
+
+/* directory of the binary copies of the parsed GPX files, NULL if none */
+extern const char *gpx_cache_dir;
+
+/*
+ * gpx_read_file(), unless the cache has the points of the unchanged file.
+ * The cache is updated after the file has been parsed.
+ */
+struct gpx_data *gpx_cache_read_file(const char *path);
+
+#endif /* _GPX_CACHE_H_ */
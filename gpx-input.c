@@ -0,0 +1,249 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#ifdef HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "gpx-input.h"
+
+#define INPUT_BUF_SIZE (64u << 10)
+
+enum input_type
+{
+	INPUT_GZIP,
+	INPUT_BZIP2,
+	INPUT_ZSTD,
+};
+
+struct gpx_input
+{
+	enum input_type type;
+	int fd;
+	int eof; /* of the compressed file */
+	union {
+		gzFile gz;
+#ifdef HAVE_BZIP2
+		bz_stream bz;
+#endif
+#ifdef HAVE_ZSTD
+		struct {
+			ZSTD_DStream *ds;
+			ZSTD_inBuffer in;
+		} zstd;
+#endif
+	};
+	char buf[]; /* INPUT_BUF_SIZE of compressed data, but for gzip */
+};
+
+static int input_type(int fd, enum input_type *type)
+{
+	unsigned char magic[4];
+
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		return -1;
+	if (magic[0] == 0x1f && magic[1] == 0x8b)
+		*type = INPUT_GZIP;
+#ifdef HAVE_BZIP2
+	else if (memcmp(magic, "BZh", 3) == 0)
+		*type = INPUT_BZIP2;
+#endif
+#ifdef HAVE_ZSTD
+	else if (memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0)
+		*type = INPUT_ZSTD;
+#endif
+	else
+		return -1;
+	return 0;
+}
+
+struct gpx_input *gpx_input_open(const char *path)
+{
+	struct gpx_input *in;
+	enum input_type type;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (input_type(fd, &type)) {
+		close(fd);
+		return NULL;
+	}
+	in = calloc(1, sizeof(*in) + (type == INPUT_GZIP ? 0 : INPUT_BUF_SIZE));
+	if (!in) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+	in->type = type;
+	in->fd = fd;
+	switch (type) {
+	case INPUT_GZIP:
+		in->gz = gzdopen(fd, "rb");
+		if (!in->gz)
+			goto err;
+		gzbuffer(in->gz, INPUT_BUF_SIZE);
+		break;
+#ifdef HAVE_BZIP2
+	case INPUT_BZIP2:
+		if (BZ2_bzDecompressInit(&in->bz, 0, 0) != BZ_OK)
+			goto err;
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case INPUT_ZSTD:
+		in->zstd.ds = ZSTD_createDStream();
+		if (!in->zstd.ds)
+			goto err;
+		in->zstd.in.src = in->buf;
+		break;
+#endif
+	default:
+		goto err;
+	}
+	return in;
+err:
+	close(fd);
+	free(in);
+	return NULL;
+}
+
+/* returns the number of bytes read into the input buffer, -1 on errors */
+static int input_fill(struct gpx_input *in)
+{
+	ssize_t r;
+
+	do
+		r = read(in->fd, in->buf, INPUT_BUF_SIZE);
+	while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return -1;
+	if (!r)
+		in->eof = 1;
+	return r;
+}
+
+#ifdef HAVE_BZIP2
+static int bzip2_read(struct gpx_input *in, char *buf, int len)
+{
+	bz_stream *bz = &in->bz;
+
+	bz->next_out = buf;
+	bz->avail_out = len;
+	while (bz->avail_out) {
+		int r;
+
+		if (!bz->avail_in) {
+			if (in->eof)
+				break;
+			r = input_fill(in);
+			if (r < 0)
+				return -1;
+			bz->next_in = in->buf;
+			bz->avail_in = r;
+			continue;
+		}
+		r = BZ2_bzDecompress(bz);
+		if (r == BZ_STREAM_END) {
+			/* concatenated streams, as written by pbzip2 */
+			char *next_in = bz->next_in;
+			unsigned avail_in = bz->avail_in;
+			unsigned avail_out = bz->avail_out;
+
+			BZ2_bzDecompressEnd(bz);
+			if (BZ2_bzDecompressInit(bz, 0, 0) != BZ_OK)
+				return -1;
+			bz->next_in = next_in;
+			bz->avail_in = avail_in;
+			bz->next_out = buf + (len - avail_out);
+			bz->avail_out = avail_out;
+		} else if (r != BZ_OK)
+			return -1;
+	}
+	return len - bz->avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int zstd_read(struct gpx_input *in, char *buf, int len)
+{
+	ZSTD_outBuffer out = { .dst = buf, .size = len, .pos = 0 };
+
+	while (out.pos < out.size) {
+		size_t r;
+
+		if (in->zstd.in.pos == in->zstd.in.size) {
+			int n;
+
+			if (in->eof)
+				break;
+			n = input_fill(in);
+			if (n < 0)
+				return -1;
+			in->zstd.in.size = n;
+			in->zstd.in.pos = 0;
+			continue;
+		}
+		r = ZSTD_decompressStream(in->zstd.ds, &out, &in->zstd.in);
+		if (ZSTD_isError(r))
+			return -1;
+	}
+	return out.pos;
+}
+#endif
+
+int gpx_input_read(void *ctx, char *buf, int len)
+{
+	struct gpx_input *in = ctx;
+
+	switch (in->type) {
+	case INPUT_GZIP:
+		return gzread(in->gz, buf, len);
+#ifdef HAVE_BZIP2
+	case INPUT_BZIP2:
+		return bzip2_read(in, buf, len);
+#endif
+#ifdef HAVE_ZSTD
+	case INPUT_ZSTD:
+		return zstd_read(in, buf, len);
+#endif
+	default:
+		return -1;
+	}
+}
+
+int gpx_input_close(void *ctx)
+{
+	struct gpx_input *in = ctx;
+
+	switch (in->type) {
+	case INPUT_GZIP:
+		/* closes the fd */
+		gzclose(in->gz);
+		free(in);
+		return 0;
+#ifdef HAVE_BZIP2
+	case INPUT_BZIP2:
+		BZ2_bzDecompressEnd(&in->bz);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case INPUT_ZSTD:
+		ZSTD_freeDStream(in->zstd.ds);
+		break;
+#endif
+	default:
+		break;
+	}
+	close(in->fd);
+	free(in);
+	return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef _GPX_INPUT_H_
+#define _GPX_INPUT_H_
+
+/*
+ * Compressed GPX files, recognized by their magic bytes: gzip, bzip2 and
+ * (if built with libzstd) zstd. They are decompressed while being parsed,
+ * through the I/O callbacks of libxml2.
+ */
+struct gpx_input;
+
+/* NULL if the file is not compressed, or cannot be read */
+struct gpx_input *gpx_input_open(const char *path);
+
+/* xmlInputReadCallback and xmlInputCloseCallback */
+int gpx_input_read(void *in, char *buf, int len);
+int gpx_input_close(void *in);
+
+#endif /* _GPX_INPUT_H_ */
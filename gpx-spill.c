@@ -0,0 +1,411 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "gpx-spill.h"
+
+/*
+ * A piece is struct spill_header, then its columns, each aligned to
+ * SPILL_ALIGN: merc, flags and, if in columns, speed and pdop. The pieces
+ * are gathered in a buffer of SPILL_BUF bytes before they are written.
+ *
+ * Their index goes to a second file, in runs of SPILL_RUN entries sorted
+ * in memory, which gpx_spill_read() merges: only the last run, and
+ * SPILL_READ entries of each run while reading, are in memory.
+ */
+#define SPILL_ALIGN (8u)
+#define SPILL_BUF (256u << 10)
+#define SPILL_RUN (8192u)
+#define SPILL_READ (128u)
+
+struct spill_header
+{
+	uint32_t points_cnt, tag, columns, pad;
+};
+
+struct spill_piece
+{
+	uint64_t key, seq;
+	off_t off;
+	size_t size;
+};
+
+struct gpx_spill
+{
+	int fd, index_fd;
+	pthread_mutex_t lock;
+	off_t size; /* of the pieces, with those in buf */
+	size_t max_size; /* of a piece */
+	char *buf;
+	size_t buf_cnt;
+	struct spill_piece *run; /* the index of the pieces since the last run */
+	size_t run_cnt, pieces_cnt;
+	int err;
+};
+
+static size_t spill_align(size_t size)
+{
+	return (size + SPILL_ALIGN - 1) & ~(size_t)(SPILL_ALIGN - 1);
+}
+
+/* an unlinked temporary file in dir, -1 on errors */
+static int spill_open(const char *dir)
+{
+	char *path;
+	int fd;
+
+	if (asprintf(&path, "%s/gpx2tiles.XXXXXX", dir) < 0)
+		return -1;
+	fd = mkstemp(path);
+	if (fd < 0)
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	else
+		/* it goes away with the process */
+		unlink(path);
+	free(path);
+	return fd;
+}
+
+struct gpx_spill *gpx_spill_create(const char *dir)
+{
+	struct gpx_spill *sp = calloc(1, sizeof(*sp));
+
+	if (!sp)
+		return NULL;
+	sp->fd = spill_open(dir);
+	sp->index_fd = sp->fd < 0 ? -1 : spill_open(dir);
+	sp->buf = malloc(SPILL_BUF);
+	sp->run = malloc(SPILL_RUN * sizeof(*sp->run));
+	if (sp->index_fd < 0 || !sp->buf || !sp->run) {
+		if (sp->index_fd >= 0)
+			close(sp->index_fd);
+		if (sp->fd >= 0)
+			close(sp->fd);
+		free(sp->buf);
+		free(sp->run);
+		free(sp);
+		return NULL;
+	}
+	pthread_mutex_init(&sp->lock, NULL);
+	return sp;
+}
+
+/* the offsets of the columns in a piece of n points, and its size */
+static size_t spill_layout(uint32_t n, unsigned columns, size_t *flags,
+			   size_t *speed, size_t *pdop)
+{
+	size_t size = spill_align(sizeof(struct spill_header)) +
+		spill_align(n * sizeof(struct merc));
+
+	*flags = size;
+	size += spill_align(n * sizeof(uint16_t));
+	*speed = size;
+	if (columns & GPX_PT_SPEED)
+		size += spill_align(n * sizeof(float));
+	*pdop = size;
+	if (columns & GPX_PT_PDOP)
+		size += spill_align(n * sizeof(float));
+	return size;
+}
+
+static int spill_pwrite(int fd, const char *p, size_t size, off_t off)
+{
+	while (size) {
+		ssize_t r = pwrite(fd, p, size, off);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += r;
+		size -= r;
+		off += r;
+	}
+	return 0;
+}
+
+static int spill_pread(int fd, char *p, size_t size, off_t off)
+{
+	while (size) {
+		ssize_t r = pread(fd, p, size, off);
+
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (!r)
+				errno = EIO;
+			return -1;
+		}
+		p += r;
+		size -= r;
+		off += r;
+	}
+	return 0;
+}
+
+/* the piece at p, of size bytes */
+static void spill_fill(char *p, size_t size, unsigned tag,
+		       const struct gpx_segment *seg, const int *idx,
+		       int start, int n)
+{
+	const unsigned columns = seg->columns & (GPX_PT_SPEED | GPX_PT_PDOP);
+	struct spill_header *h = (struct spill_header *)p;
+	size_t flags, speed, pdop;
+	int k;
+
+	spill_layout(n, columns, &flags, &speed, &pdop);
+	memset(p, 0, size);
+	h->points_cnt = n;
+	h->tag = tag;
+	h->columns = columns;
+	for (k = 0; k < n; ++k) {
+		const int i = idx ? idx[start + k] : start + k;
+
+		((struct merc *)(p + spill_align(sizeof(*h))))[k] = seg->merc[i];
+		((uint16_t *)(p + flags))[k] = seg->flags[i];
+		if (columns & GPX_PT_SPEED)
+			((float *)(p + speed))[k] = seg->speed[i];
+		if (columns & GPX_PT_PDOP)
+			((float *)(p + pdop))[k] = seg->pdop[i];
+	}
+}
+
+/* the pieces in buf, at the end of the file, with the lock held */
+static int spill_flush(struct gpx_spill *sp)
+{
+	int err = spill_pwrite(sp->fd, sp->buf, sp->buf_cnt,
+			       sp->size - sp->buf_cnt);
+
+	sp->buf_cnt = 0;
+	return err;
+}
+
+static int piece_cmp(const void *a, const void *b)
+{
+	const struct spill_piece *pa = a, *pb = b;
+
+	if (pa->key != pb->key)
+		return pa->key < pb->key ? -1 : 1;
+	if (pa->seq != pb->seq)
+		return pa->seq < pb->seq ? -1 : 1;
+	return 0;
+}
+
+/* the index since the last run, as the next one, with the lock held */
+static int spill_flush_run(struct gpx_spill *sp)
+{
+	const off_t off = (off_t)(sp->pieces_cnt - sp->run_cnt) * sizeof(*sp->run);
+	int err;
+
+	qsort(sp->run, sp->run_cnt, sizeof(*sp->run), piece_cmp);
+	err = spill_pwrite(sp->index_fd, (const char *)sp->run,
+			   sp->run_cnt * sizeof(*sp->run), off);
+	sp->run_cnt = 0;
+	return err;
+}
+
+int gpx_spill_write(struct gpx_spill *sp, uint64_t key, uint64_t seq, unsigned tag,
+		    const struct gpx_segment *seg, const int *idx, int start, int n)
+{
+	const unsigned columns = seg->columns & (GPX_PT_SPEED | GPX_PT_PDOP);
+	struct spill_piece *piece;
+	size_t size, flags, speed, pdop;
+	char *big = NULL;
+	int err = 0;
+
+	size = spill_layout(n, columns, &flags, &speed, &pdop);
+	/* bigger than the buffer, it is written on its own */
+	if (size > SPILL_BUF) {
+		big = malloc(size);
+		if (!big)
+			return -1;
+		spill_fill(big, size, tag, seg, idx, start, n);
+	}
+
+	pthread_mutex_lock(&sp->lock);
+	if (sp->buf_cnt + size > SPILL_BUF)
+		err = spill_flush(sp);
+	if (big) {
+		if (!err)
+			err = spill_pwrite(sp->fd, big, size, sp->size);
+	} else {
+		spill_fill(sp->buf + sp->buf_cnt, size, tag, seg, idx, start, n);
+		sp->buf_cnt += size;
+	}
+	piece = sp->run + sp->run_cnt++;
+	piece->key = key;
+	piece->seq = seq;
+	piece->off = sp->size;
+	piece->size = size;
+	sp->pieces_cnt++;
+	sp->size += size;
+	if (sp->max_size < size)
+		sp->max_size = size;
+	if (sp->run_cnt == SPILL_RUN && !err)
+		err = spill_flush_run(sp);
+	if (err && !sp->err)
+		perror("spill");
+	if (err)
+		sp->err = err;
+	pthread_mutex_unlock(&sp->lock);
+
+	free(big);
+	return err;
+}
+
+int gpx_spill_sort(struct gpx_spill *sp)
+{
+	int err;
+
+	pthread_mutex_lock(&sp->lock);
+	err = sp->err;
+	if (!err && sp->buf_cnt)
+		err = spill_flush(sp);
+	if (!err && sp->run_cnt)
+		err = spill_flush_run(sp);
+	if (err && !sp->err)
+		perror("spill");
+	sp->err = err;
+	free(sp->buf);
+	free(sp->run);
+	sp->buf = NULL;
+	sp->run = NULL;
+	pthread_mutex_unlock(&sp->lock);
+	return err;
+}
+
+/* the entries of a run not yet read, SPILL_READ of them at a time */
+struct spill_cursor
+{
+	struct spill_piece *pieces;
+	size_t pos, cnt;
+	off_t off, end; /* in the index file */
+};
+
+/* the next entries of the run, 0 at its end */
+static size_t spill_cursor_fill(struct gpx_spill *sp, struct spill_cursor *c)
+{
+	size_t n = (c->end - c->off) / sizeof(*c->pieces);
+
+	if (n > SPILL_READ)
+		n = SPILL_READ;
+
+	c->pos = 0;
+	c->cnt = 0;
+	if (!n)
+		return 0;
+	if (spill_pread(sp->index_fd, (char *)c->pieces, n * sizeof(*c->pieces),
+			c->off))
+		return 0;
+	c->off += n * sizeof(*c->pieces);
+	return c->cnt = n;
+}
+
+static int cursor_cmp(const struct spill_cursor *a, const struct spill_cursor *b)
+{
+	return piece_cmp(a->pieces + a->pos, b->pieces + b->pos);
+}
+
+/* the heap of the cursors, by their next entries, from i down */
+static void spill_heap_down(struct spill_cursor **heap, size_t cnt, size_t i)
+{
+	for (;;) {
+		size_t m = i, l = 2 * i + 1, r = 2 * i + 2;
+		struct spill_cursor *t;
+
+		if (l < cnt && cursor_cmp(heap[l], heap[m]) < 0)
+			m = l;
+		if (r < cnt && cursor_cmp(heap[r], heap[m]) < 0)
+			m = r;
+		if (m == i)
+			return;
+		t = heap[i];
+		heap[i] = heap[m];
+		heap[m] = t;
+		i = m;
+	}
+}
+
+int gpx_spill_read(struct gpx_spill *sp,
+		   void (*fn)(const struct gpx_segment *seg, unsigned tag, void *arg),
+		   void *arg)
+{
+	const size_t runs = (sp->pieces_cnt + SPILL_RUN - 1) / SPILL_RUN;
+	struct spill_cursor *cursors = calloc(runs ? runs : 1, sizeof(*cursors));
+	struct spill_cursor **heap = malloc((runs ? runs : 1) * sizeof(*heap));
+	struct spill_piece *entries = malloc((runs ? runs : 1) * SPILL_READ *
+					     sizeof(*entries));
+	char *buf = malloc(sp->max_size ? sp->max_size : 1);
+	size_t i, heap_cnt = 0;
+	int err = -1;
+
+	if (!cursors || !heap || !entries || !buf)
+		goto out;
+	for (i = 0; i < runs; ++i) {
+		struct spill_cursor *c = cursors + i;
+
+		c->pieces = entries + i * SPILL_READ;
+		c->off = (off_t)i * SPILL_RUN * sizeof(*c->pieces);
+		c->end = c->off + (off_t)SPILL_RUN * sizeof(*c->pieces);
+		if (i == runs - 1)
+			c->end = (off_t)sp->pieces_cnt * sizeof(*c->pieces);
+		if (!spill_cursor_fill(sp, c))
+			goto out_perror;
+		heap[heap_cnt++] = c;
+	}
+	for (i = heap_cnt / 2; i-- > 0;)
+		spill_heap_down(heap, heap_cnt, i);
+	while (heap_cnt) {
+		struct spill_cursor *c = heap[0];
+		const struct spill_piece *piece = c->pieces + c->pos;
+		const struct spill_header *h = (const struct spill_header *)buf;
+		struct gpx_segment seg = { 0 };
+		size_t flags, speed, pdop;
+
+		if (spill_pread(sp->fd, buf, piece->size, piece->off))
+			goto out_perror;
+		spill_layout(h->points_cnt, h->columns, &flags, &speed, &pdop);
+		seg.src = GPX_SRC_UNKNOWN;
+		seg.points_cnt = h->points_cnt;
+		seg.columns = h->columns;
+		seg.merc = (struct merc *)(buf + spill_align(sizeof(*h)));
+		seg.flags = (uint16_t *)(buf + flags);
+		if (h->columns & GPX_PT_SPEED)
+			seg.speed = (float *)(buf + speed);
+		if (h->columns & GPX_PT_PDOP)
+			seg.pdop = (float *)(buf + pdop);
+		fn(&seg, h->tag, arg);
+		if (++c->pos == c->cnt && !spill_cursor_fill(sp, c)) {
+			if (c->off != c->end)
+				goto out_perror;
+			heap[0] = heap[--heap_cnt];
+		}
+		spill_heap_down(heap, heap_cnt, 0);
+	}
+	err = 0;
+	goto out;
+out_perror:
+	perror("spill");
+out:
+	free(buf);
+	free(entries);
+	free(heap);
+	free(cursors);
+	return err;
+}
+
+void gpx_spill_free(struct gpx_spill *sp)
+{
+	if (!sp)
+		return;
+	close(sp->fd);
+	close(sp->index_fd);
+	pthread_mutex_destroy(&sp->lock);
+	free(sp->buf);
+	free(sp->run);
+	free(sp);
+}
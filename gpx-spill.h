@@ -0,0 +1,42 @@
+#ifndef _GPX_SPILL_H_
+#define _GPX_SPILL_H_
+
+#include <stdint.h>
+#include "gpx.h"
+
+/*
+ * Points written out of memory: pieces of segments go to an unlinked
+ * temporary file, and are read back one at a time, in the order of their
+ * keys. Their index is kept in a second file, in sorted runs. The pieces
+ * can be written by several threads at once.
+ */
+struct gpx_spill;
+
+/* NULL on errors, reported on stderr */
+struct gpx_spill *gpx_spill_create(const char *dir);
+
+/*
+ * The points idx[start]..idx[start + n - 1] of the segment (start..start + n - 1
+ * if idx is NULL), with their locations, flags, speeds and PDOPs. The pieces
+ * with the same key are read in the order of their seq.
+ */
+int gpx_spill_write(struct gpx_spill *, uint64_t key, uint64_t seq, unsigned tag,
+		    const struct gpx_segment *seg, const int *idx, int start, int n);
+
+/*
+ * Writes out the last pieces and sorts them, before gpx_spill_read(). -1 if
+ * writing any of the pieces failed, reported on stderr.
+ */
+int gpx_spill_sort(struct gpx_spill *);
+
+/*
+ * Calls fn for every piece, as a segment without bands and without the
+ * location in degrees. Can be called by several threads at once.
+ */
+int gpx_spill_read(struct gpx_spill *,
+		   void (*fn)(const struct gpx_segment *seg, unsigned tag, void *arg),
+		   void *arg);
+
+void gpx_spill_free(struct gpx_spill *);
+
+#endif /* _GPX_SPILL_H_ */
@@ -1,10 +1,20 @@
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <libxml/parser.h>
+#include <libxml/xmlreader.h>
 #include "slist.h"
 #include "gpx.h"
+#include "gpx-input.h"
 
 #define countof(a) (sizeof(a) / sizeof((a)[0]))
 #define ASCII (char *)
@@ -25,33 +35,29 @@ const char GPX_SRC_NETWORK[] = "network";
 const char GPX_SRC_WAYPOINT[] = "<wpt>";
 const char GPX_SRC_UNKNOWN[] = "";
 
-static int static_gpx_src(const char *s)
-{
-	return s == GPX_SRC_UNKNOWN || s == GPX_SRC_GPS || s == GPX_SRC_NETWORK;
-}
-
 struct segtab_entry
 {
 	struct segtab_entry *next;
 	char *src;
-	struct gpx_segment *seg;
+	SLIST_DECLARE(struct gpx_point, points);
 };
 
 struct segtab {
 	SLIST_STACK_DECLARE(struct segtab_entry, segs);
 	struct segtab_entry reserve[10];
 	int reserve_use;
+	struct arena *arena;
 };
 
 static struct segtab_entry *put_segtab_src(struct segtab *tab, char *src)
 {
 	struct segtab_entry *e;
 	if (tab->reserve_use == countof(tab->reserve))
-		e = malloc(sizeof(*e));
+		e = arena_alloc(tab->arena, sizeof(*e));
 	else
 		e = tab->reserve + tab->reserve_use++;
 	e->src = src;
-	e->seg = NULL;
+	slist_init(&e->points);
 	slist_push(&tab->segs, e);
 	return e;
 }
@@ -63,52 +69,43 @@ static struct segtab_entry *get_segtab(struct segtab *tab, const char *src)
 	slist_for_each(e, &tab->segs)
 		if (strcmp(e->src, src) == 0)
 			goto done;
-	e = put_segtab_src(tab, strdup(src));
+	e = put_segtab_src(tab, arena_strdup(tab->arena, src));
 done:
 	return e;
 }
 
-static void init_segtab(struct segtab *tab)
+static void init_segtab(struct segtab *tab, struct arena *arena)
 {
 	tab->segs.head = NULL;
 	tab->reserve_use = 0;
+	tab->arena = arena;
 	put_segtab_src(tab, (char *)GPX_SRC_UNKNOWN);
 	put_segtab_src(tab, (char *)GPX_SRC_NETWORK);
 	put_segtab_src(tab, (char *)GPX_SRC_GPS);
 }
 
-static void segtab_cleanup(struct segtab *tab)
-{
-	while (!slist_empty(&tab->segs)) {
-		struct segtab_entry *e = slist_stack_pop(&tab->segs);
-
-		if (tab->reserve <= e && e < tab->reserve + countof(tab->reserve))
-			continue;
-		if (!static_gpx_src(e->src))
-			free(e->src);
-		free_trk_segment(e->seg);
-		free(e);
-	}
-}
+/*
+ * The points of the <trkseg> being parsed, reset once they are packed into
+ * their segments, see trkseg_end().
+ */
+static __thread struct arena gpx_scratch;
 
-struct gpx_point *new_trk_point(void)
+struct gpx_point *new_trk_point(struct arena *arena)
 {
-	struct gpx_point *pt = malloc(sizeof(*pt));
+	struct gpx_point *pt = arena_alloc(arena, sizeof(*pt));
 
 	pt->next = NULL;
 	pt->flags = 0;
 	pt->loc.lat = pt->loc.lon = 0.0;
+	pt->time = 0;
+	pt->ele = 0.0;
 	return pt;
 }
 
-void free_trk_point(struct gpx_point *pt)
-{
-	free(pt);
-}
-
-void put_trk_point(struct gpx_segment *seg, struct gpx_point *pt)
+/* the memory is reused only if the point was the last allocation */
+void free_trk_point(struct arena *arena, struct gpx_point *pt)
 {
-	slist_append(&seg->points, pt);
+	arena_unalloc(arena, pt, sizeof(*pt));
 }
 
 void merge_trk_points(struct gpx_point *dest, const struct gpx_point *src)
@@ -120,7 +117,7 @@ void merge_trk_points(struct gpx_point *dest, const struct gpx_point *src)
 		dest->flags |= GPX_PT_LATLON;
 	}
 	if (flags & GPX_PT_TIME) {
-		strcpy(dest->time, src->time);
+		dest->time = src->time;
 		dest->flags |= GPX_PT_TIME;
 	}
 	if (flags & GPX_PT_ELE) {
@@ -161,7 +158,7 @@ unsigned gpx_point_compare(const struct gpx_point *a, const struct gpx_point *b)
 	if ((flags & GPX_PT_LATLON) && !(a->loc.lat == b->loc.lat &&
 					 a->loc.lon == b->loc.lon))
 		flags &= ~GPX_PT_LATLON;
-	if ((flags & GPX_PT_TIME) && strcmp(a->time, b->time))
+	if ((flags & GPX_PT_TIME) && a->time != b->time)
 		flags &= ~GPX_PT_TIME;
 	if ((flags & GPX_PT_ELE) && a->ele != b->ele)
 		flags &= ~GPX_PT_ELE;
@@ -180,57 +177,278 @@ unsigned gpx_point_compare(const struct gpx_point *a, const struct gpx_point *b)
 	return flags;
 }
 
+/*
+ * strtod()/strtof() for the plain decimal numbers found in GPX files.
+ * Exact, if the digits fit into the mantissa and the power of ten can be
+ * represented (Clinger's fast path). Falls back to the libc otherwise.
+ */
+static const char *scan_decimal(const char *p, uint64_t *m, int *frac)
+{
+	int digits = 0;
+
+	*m = 0;
+	*frac = 0;
+	for (; isdigit((unsigned char)*p) && digits < 19; ++p, ++digits)
+		*m = *m * 10 + (*p - '0');
+	if (*p == '.')
+		for (++p; isdigit((unsigned char)*p) && digits < 19; ++p, ++digits, ++*frac)
+			*m = *m * 10 + (*p - '0');
+	if (!digits || isdigit((unsigned char)*p) || *p == 'e' || *p == 'E')
+		return NULL;
+	return p;
+}
+
+static double parse_double(const char *s, char **end)
+{
+	static const double pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+	};
+	const char *p;
+	uint64_t m;
+	int frac, neg = *s == '-';
+	double v;
+
+	p = scan_decimal(s + (neg || *s == '+'), &m, &frac);
+	if (!p || m > (1ull << 53) || frac >= (int)countof(pow10))
+		return strtod(s, end);
+	if (end)
+		*end = (char *)p;
+	v = (double)m / pow10[frac];
+	return neg ? -v : v;
+}
+
+static float parse_float(const char *s)
+{
+	static const float pow10[] = {
+		1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f,
+	};
+	const char *p;
+	uint64_t m;
+	int frac, neg = *s == '-';
+	float v;
+
+	p = scan_decimal(s + (neg || *s == '+'), &m, &frac);
+	if (!p || m > (1ull << 24) || frac >= (int)countof(pow10))
+		return strtof(s, NULL);
+	v = (float)m / pow10[frac];
+	return neg ? -v : v;
+}
+
+static int parse_coord(const xmlChar *s, double *v)
+{
+	char *err;
+
+	if (!s)
+		return -1;
+	*v = parse_double(ASCII s, &err);
+	if ((*v == 0.0 && ASCII s == err) || *v == HUGE_VAL)
+		return -1;
+	return 0;
+}
+
+/* days since 1970-01-01 of a date of the proleptic Gregorian calendar */
+static int64_t days_from_civil(int y, int m, int d)
+{
+	int era, yoe, doy, doe;
+
+	y -= m <= 2;
+	era = (y >= 0 ? y : y - 399) / 400;
+	yoe = y - era * 400;
+	doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return (int64_t)era * 146097 + doe - 719468;
+}
+
+static int scan_digits(const char *s, int n)
+{
+	int v = 0;
+
+	for (; n; --n, ++s) {
+		if (!isdigit((unsigned char)*s))
+			return -1;
+		v = v * 10 + (*s - '0');
+	}
+	return v;
+}
+
+/* the milliseconds of an optional fraction of a second */
+static const char *scan_frac(const char *p, int *frac)
+{
+	int scale = 100;
+
+	*frac = 0;
+	if (*p == '.')
+		for (++p; isdigit((unsigned char)*p); ++p, scale /= 10)
+			*frac += (*p - '0') * scale;
+	return p;
+}
+
+/*
+ * The offset in minutes of an optional time zone: "Z", "+hh", "+hhmm" or
+ * "+hh:mm". NULL if it is broken.
+ */
+static const char *scan_zone(const char *p, int *off)
+{
+	int oh, om = 0;
+	const char *q;
+
+	*off = 0;
+	if (*p == 'Z' || *p == 'z')
+		return p + 1;
+	if (*p != '+' && *p != '-')
+		return p;
+	oh = scan_digits(p + 1, 2);
+	if (oh < 0 || oh > 23)
+		return NULL;
+	q = p + 3;
+	if (*q == ':' || isdigit((unsigned char)*q)) {
+		q += *q == ':';
+		om = scan_digits(q, 2);
+		if (om < 0 || om > 59)
+			return NULL;
+		q += 2;
+	}
+	*off = (*p == '-' ? -1 : 1) * (oh * 60 + om);
+	return q;
+}
+
+/*
+ * Milliseconds since the epoch of a time as written in the GPX files:
+ * "2016-06-25T09:51:57Z", with optional fraction of a second and time zone
+ * offset. Anything else is left to strptime(), still with the fraction and
+ * the time zone after the seconds.
+ */
+static int parse_gpxtime(const char *s, int64_t *ms)
+{
+	int Y, M, D, h, m, sec, frac, off;
+	const char *p;
+	struct tm tm;
+
+	while (isspace((unsigned char)*s))
+		++s;
+	if ((Y = scan_digits(s, 4)) < 0 || s[4] != '-' ||
+	    (M = scan_digits(s + 5, 2)) < 1 || M > 12 || s[7] != '-' ||
+	    (D = scan_digits(s + 8, 2)) < 1 || D > 31 ||
+	    (s[10] != 'T' && s[10] != 't' && s[10] != ' ') ||
+	    (h = scan_digits(s + 11, 2)) < 0 || h > 23 || s[13] != ':' ||
+	    (m = scan_digits(s + 14, 2)) < 0 || m > 59 || s[16] != ':' ||
+	    (sec = scan_digits(s + 17, 2)) < 0 || sec > 60)
+		goto slow;
+	p = scan_zone(scan_frac(s + 19, &frac), &off);
+	if (!p)
+		goto slow;
+	while (isspace((unsigned char)*p))
+		++p;
+	if (*p)
+		goto slow;
+	*ms = ((days_from_civil(Y, M, D) * 24 + h) * 3600 +
+	       m * 60 + sec - off * 60) * 1000 + frac;
+	return 0;
+slow:
+	memset(&tm, 0, sizeof(tm));
+	p = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (!p)
+		return -1;
+	/* a broken time zone is ignored, as it always was */
+	if (!scan_zone(scan_frac(p, &frac), &off))
+		off = 0;
+	*ms = ((int64_t)timegm(&tm) - off * 60) * 1000 + frac;
+	return 0;
+}
+
+char *gpx_format_time(char *buf, size_t size, int64_t ms)
+{
+	time_t t = ms / 1000;
+	int frac = ms % 1000;
+	struct tm tm;
+	size_t l;
+
+	if (frac < 0) {
+		frac += 1000;
+		--t;
+	}
+	l = strftime(buf, size, "%Y-%m-%dT%H:%M:%S", gmtime_r(&t, &tm));
+	if (frac)
+		snprintf(buf + l, size - l, ".%03dZ", frac);
+	else
+		snprintf(buf + l, size - l, "Z");
+	return buf;
+}
+
+/* the children of the points parse_trkpt_field() uses */
+static const char *const trkpt_fields[] = {
+	"time", "src", "speed", "sat", "ele", "course", "hdop", "vdop", "pdop",
+};
+
+static int trkpt_field_used(const xmlChar *name)
+{
+	size_t i;
+
+	for (i = 0; i < countof(trkpt_fields); ++i)
+		if (xmlStrcasecmp(name, BAD_CAST trkpt_fields[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * Store the content of a child element of <trkpt> or <wpt> in the point.
+ * Returns the segment table entry if the element was a <src>.
+ */
+static struct segtab_entry *parse_trkpt_field(struct gpx_point *pt,
+					      const xmlChar *name,
+					      const xmlChar *s,
+					      struct segtab *segs)
+{
+	float *f;
+
+	if (xmlStrcasecmp(name, BAD_CAST "time") == 0) {
+		if (parse_gpxtime(ASCII s, &pt->time) == 0)
+			pt->flags |= GPX_PT_TIME;
+		return NULL;
+	} else if (xmlStrcasecmp(name, BAD_CAST "src") == 0) {
+		return segs ? get_segtab(segs, ASCII s) : NULL;
+	} else if (xmlStrcasecmp(name, BAD_CAST "speed") == 0) {
+		pt->flags |= GPX_PT_SPEED;
+		pt->speed = parse_double(ASCII s, NULL);
+		return NULL;
+	} else if (xmlStrcasecmp(name, BAD_CAST "sat") == 0) {
+		pt->flags |= GPX_PT_SAT;
+		pt->sat = strtol(ASCII s, NULL, 10);
+		return NULL;
+	} else if (xmlStrcasecmp(name, BAD_CAST "ele") == 0) {
+		pt->flags |= GPX_PT_ELE;
+		f = &pt->ele;
+	} else if (xmlStrcasecmp(name, BAD_CAST "course") == 0) {
+		pt->flags |= GPX_PT_COURSE;
+		f = &pt->course;
+	} else if (xmlStrcasecmp(name, BAD_CAST "hdop") == 0) {
+		pt->flags |= GPX_PT_HDOP;
+		f = &pt->hdop;
+	} else if (xmlStrcasecmp(name, BAD_CAST "vdop") == 0) {
+		pt->flags |= GPX_PT_VDOP;
+		f = &pt->vdop;
+	} else if (xmlStrcasecmp(name, BAD_CAST "pdop") == 0) {
+		pt->flags |= GPX_PT_PDOP;
+		f = &pt->pdop;
+	} else
+		return NULL;
+	*f = parse_float(ASCII s);
+	return NULL;
+}
+
 static struct segtab_entry *parse_trkpt(xmlNode *xpt, struct gpx_point *pt, struct segtab *segs)
 {
 	struct segtab_entry *e = NULL;
 
 	for (xpt = xmlFirstElementChild(xpt); xpt;
 	     xpt = xmlNextElementSibling(xpt)) {
-		xmlChar *s;
-		float *f;
-		if (xmlStrcasecmp(xpt->name, BAD_CAST "time") == 0) {
-			pt->flags |= GPX_PT_TIME;
-			s = xmlNodeGetContent(xpt);
-			xmlCharCopy(pt->time, sizeof(pt->time), s);
-			goto frees;
-		} else if (xmlStrcasecmp(xpt->name, BAD_CAST "src") == 0) {
-			s = xmlNodeGetContent(xpt);
-			if (segs)
-				e = get_segtab(segs, (char *)s);
-			goto frees;
-		} else if (xmlStrcasecmp(xpt->name, BAD_CAST "speed") == 0) {
-			pt->flags |= GPX_PT_SPEED;
-			s = xmlNodeGetContent(xpt);
-			pt->speed = strtod(ASCII s, NULL);
-			goto frees;
-		} else if (xmlStrcasecmp(xpt->name, BAD_CAST "sat") == 0) {
-			pt->flags |= GPX_PT_SAT;
-			s = xmlNodeGetContent(xpt);
-			pt->sat = strtol(ASCII s, NULL, 10);
-			goto frees;
-		} else if (xmlStrcasecmp(xpt->name, BAD_CAST "ele") == 0) {
-			pt->flags |= GPX_PT_ELE;
-			f = &pt->ele;
-		} else if (xmlStrcasecmp(xpt->name, BAD_CAST "geoidheight") == 0) {
-			pt->flags |= GPX_PT_ELE;
-			f = &pt->geoidheight;
-		} else if (xmlStrcasecmp(xpt->name, BAD_CAST "course") == 0) {
-			pt->flags |= GPX_PT_COURSE;
-			f = &pt->course;
-		} else if (xmlStrcasecmp(xpt->name, BAD_CAST "hdop") == 0) {
-			pt->flags |= GPX_PT_HDOP;
-			f = &pt->hdop;
-		} else if (xmlStrcasecmp(xpt->name, BAD_CAST "vdop") == 0) {
-			pt->flags |= GPX_PT_VDOP;
-			f = &pt->vdop;
-		} else if (xmlStrcasecmp(xpt->name, BAD_CAST "pdop") == 0) {
-			pt->flags |= GPX_PT_PDOP;
-			f = &pt->pdop;
-		} else
-			continue;
-		s = xmlNodeGetContent(xpt);
-		*f = strtof(ASCII s, NULL);
-	frees:
+		struct segtab_entry *src;
+		xmlChar *s = xmlNodeGetContent(xpt);
+
+		src = parse_trkpt_field(pt, xpt->name, s, segs);
+		if (src)
+			e = src;
 		xmlFree(s);
 	}
 	return e;
@@ -257,212 +475,371 @@ double earth_distance(const struct gpx_latlon *latlng1,
 	return R * acos(a < 1.0 ? a : 1.0);
 }
 
-static time_t gpxtime2sec(const char *t)
-{
-	char *p;
-	struct tm tm;
-	time_t utc = time(NULL);
-
-	tm = *gmtime(&utc);
-	p = strptime(t, "%Y-%m-%dT%H:%M:%S", &tm);
-	if (p)
-		return mktime(&tm);
-	return utc;
-}
-
 static void synthesize_speed(struct gpx_point *pt, const struct gpx_point *ppt)
 {
 	extern int verbose;
+	char t1[32], t2[32];
 
-	pt->flags = GPX_PT_SPEED;
+	pt->flags |= GPX_PT_SPEED;
 	if ((ppt->flags & GPX_PT_SPEED) && pt->next && (pt->next->flags & GPX_PT_SPEED)) {
 		pt->speed = (ppt->speed + pt->next->speed) / 2.0;
 		if (verbose > 1)
 			fprintf(stderr, "speed:   averaged %5.2f kph from %s (%3.2f) to %s (%3.2f)\n",
 				pt->speed * 3.6,
-				ppt->time, ppt->speed * 3.6,
-				pt->next->time, pt->next->speed * 3.6);
+				gpx_format_time(t1, sizeof(t1), ppt->time), ppt->speed * 3.6,
+				gpx_format_time(t2, sizeof(t2), pt->next->time),
+				pt->next->speed * 3.6);
 	} else {
 		double d = earth_distance(&ppt->loc, &pt->loc);
-		time_t t = gpxtime2sec(pt->time) - gpxtime2sec(ppt->time);
-		if (t < 1)
-			t = 1;
-		pt->speed = d / (double)t;
+		double t = 1.0;
+
+		if (ppt->flags & GPX_PT_TIME)
+			t = (pt->time - ppt->time) / 1000.0;
+		if (t < 1.0)
+			t = 1.0;
+		pt->speed = d / t;
 		if (verbose > 1)
-			fprintf(stderr, "speed: calculated %5.2f kph from %s to %s: %.2f m, %ld sec, "
+			fprintf(stderr, "speed: calculated %5.2f kph from %s to %s: %.2f m, %.3f sec, "
 				"PDOP %.1f\n",
 				3.6 * pt->speed,
-				ppt->time, pt->time,
-				d, (long)t,
+				gpx_format_time(t1, sizeof(t1), ppt->time),
+				gpx_format_time(t2, sizeof(t2), pt->time),
+				d, t,
 				pt->flags & GPX_PT_PDOP ? pt->pdop : 99.);
 	}
 }
 
-static int process_trk_points(struct gpx_data *gpxf, xmlNode *xpt /*, int trk, int nseg*/)
+/* State of a <trkseg> being parsed: the points are sorted by their source */
+struct trkseg
 {
-	int ptcnt = 0;
-	int synspeed = 0;
-	struct gpx_point *ppt = NULL;
-	struct segtab_entry *e, *unknown;
+	struct gpx_data *gpx;
 	struct segtab segs;
+	struct segtab_entry *unknown;
+	struct gpx_point *ppt;
+	int ptcnt, synspeed;
+};
 
-	init_segtab(&segs);
-	unknown = get_segtab(&segs, GPX_SRC_UNKNOWN);
+static void trkseg_begin(struct trkseg *ts, struct gpx_data *gpx)
+{
+	ts->gpx = gpx;
+	init_segtab(&ts->segs, &gpx->arena);
+	ts->unknown = get_segtab(&ts->segs, GPX_SRC_UNKNOWN);
+	ts->ppt = NULL;
+	ts->ptcnt = 0;
+	ts->synspeed = 0;
+}
 
-	for (; xpt; xpt = xmlNextElementSibling(xpt)) {
-		char *err, *nptr;
-		struct gpx_point *pt;
+/* Consumes the point: it is either put in a segment or freed */
+static void trkseg_put_point(struct trkseg *ts, struct gpx_point *pt,
+			     struct segtab_entry *e)
+{
+	struct gpx_point *ppt = ts->ppt;
 
-		if (xmlStrcasecmp(xpt->name, BAD_CAST "trkpt") != 0) {
-			fprintf(stderr, "Unknown element %s\n", xpt->name);
-			continue;
-		}
-		pt = new_trk_point();
-		nptr = ASCII xmlGetProp(xpt, BAD_CAST "lat");
-		pt->loc.lat = strtod(nptr, &err);
-		xmlFree(nptr);
-		if ((pt->loc.lat == 0.0 && nptr == err) || pt->loc.lat == HUGE_VAL)
-			goto fail;
-		nptr = ASCII xmlGetProp(xpt, BAD_CAST "lon");
-		pt->loc.lon = strtod(nptr, &err);
-		xmlFree(nptr);
-		if ((pt->loc.lon == 0.0 && nptr == err) || pt->loc.lon == HUGE_VAL)
-			goto fail;
-		pt->flags |= GPX_PT_LATLON;
-		e = parse_trkpt(xpt, pt, &segs);
-		if (!e)
-			e = unknown;
-		if ((pt->flags & (GPX_PT_TIME|GPX_PT_SPEED)) == GPX_PT_TIME)
-			synspeed = 1;
-		if (!(pt->flags & GPX_PT_TIME))
-			sprintf(pt->time, "%d", ptcnt);
-		//pt->trk = trk;
-		//pt->seg = nseg;
-		if (!e->seg)
-			e->seg = new_trk_segment(e->src);
-		if (ppt) {
-			unsigned same = pt->flags & ppt->flags;
-
-			if ((same & GPX_PT_LATLON) &&
-			    (same & GPX_PT_TIME) &&
-			    pt->loc.lat == ppt->loc.lat &&
-			    pt->loc.lon == ppt->loc.lon &&
-			    strcmp(pt->time, ppt->time) == 0)
-				merge_trk_points(ppt, pt);
-			same = gpx_point_compare(ppt, pt);
-			if (same == pt->flags)
-				goto fail;
+	if (!e)
+		e = ts->unknown;
+	if ((pt->flags & (GPX_PT_TIME|GPX_PT_SPEED)) == GPX_PT_TIME)
+		ts->synspeed = 1;
+	//pt->trk = trk;
+	//pt->seg = nseg;
+	if (ppt) {
+		unsigned same = pt->flags & ppt->flags;
+
+		if ((same & GPX_PT_LATLON) &&
+		    (same & GPX_PT_TIME) &&
+		    pt->loc.lat == ppt->loc.lat &&
+		    pt->loc.lon == ppt->loc.lon &&
+		    pt->time == ppt->time)
+			merge_trk_points(ppt, pt);
+		same = gpx_point_compare(ppt, pt);
+		if (same == pt->flags) {
+			free_trk_point(&gpx_scratch, pt);
+			return;
 		}
-		put_trk_point(e->seg, pt);
-		ppt = pt;
-		++ptcnt;
-		continue;
-	fail:
-		free_trk_point(pt);
-	}
-	if (!slist_empty(&segs.segs))
-		slist_for_each(e, &segs.segs) {
-			if (e->seg) {
-				if (synspeed) {
+	}
+	slist_append(&e->points, pt);
+	ts->ppt = pt;
+	++ts->ptcnt;
+}
+
+static int trkseg_end(struct gpx_data *gpxf, struct trkseg *ts)
+{
+	struct segtab_entry *e;
+
+	if (!slist_empty(&ts->segs.segs))
+		slist_for_each(e, &ts->segs.segs) {
+			if (!slist_empty(&e->points)) {
+				if (ts->synspeed) {
 					struct gpx_point *pt;
 					struct gpx_point *ppt = NULL;
 
-					for (pt = e->seg->points.head; pt; ppt = pt, pt = pt->next)
+					for (pt = e->points.head; pt; ppt = pt, pt = pt->next)
 						if ((pt->flags & (GPX_PT_TIME|GPX_PT_SPEED)) == GPX_PT_TIME && ppt)
 							synthesize_speed(pt, ppt);
 				}
-				e->seg->free_src = !static_gpx_src(e->seg->src);
-				e->src = NULL;
-				put_trk_segment(gpxf, e->seg);
-				e->seg = NULL;
+				put_trk_segment(gpxf, new_trk_segment(gpxf, e->src,
+								      e->points.head));
+				slist_init(&e->points);
 			}
 		}
-	segtab_cleanup(&segs);
-	return ptcnt;
+	arena_reset(&gpx_scratch);
+	return ts->ptcnt;
 }
 
-struct gpx_segment *new_trk_segment(const char *src)
+static int process_trk_points(struct gpx_data *gpxf, xmlNode *xpt /*, int trk, int nseg*/)
 {
-	struct gpx_segment *seg = malloc(sizeof(*seg));
+	struct trkseg ts;
+
+	trkseg_begin(&ts, gpxf);
+	for (; xpt; xpt = xmlNextElementSibling(xpt)) {
+		xmlChar *lat, *lon;
+		struct gpx_point *pt;
+		int err;
 
+		if (xmlStrcasecmp(xpt->name, BAD_CAST "trkpt") != 0) {
+			fprintf(stderr, "Unknown element %s\n", xpt->name);
+			continue;
+		}
+		pt = new_trk_point(&gpx_scratch);
+		lat = xmlGetProp(xpt, BAD_CAST "lat");
+		lon = xmlGetProp(xpt, BAD_CAST "lon");
+		err = parse_coord(lat, &pt->loc.lat) || parse_coord(lon, &pt->loc.lon);
+		xmlFree(lat);
+		xmlFree(lon);
+		if (err) {
+			free_trk_point(&gpx_scratch, pt);
+			continue;
+		}
+		pt->flags |= GPX_PT_LATLON;
+		trkseg_put_point(&ts, pt, parse_trkpt(xpt, pt, &ts.segs));
+	}
+	return trkseg_end(gpxf, &ts);
+}
+
+static void *new_column(struct gpx_data *gpx, int n, size_t size, int present)
+{
+	return present ? arena_alloc(&gpx->arena, n * size) : NULL;
+}
+
+/* Packs the list of points into the columns of a new segment */
+struct gpx_segment *new_trk_segment(struct gpx_data *gpx, const char *src,
+				    const struct gpx_point *points)
+{
+	struct gpx_segment *seg = arena_alloc(&gpx->arena, sizeof(*seg));
+	const struct gpx_point *pt;
+	unsigned columns = 0;
+	int i, n = 0;
+
+	for (pt = points; pt; pt = pt->next, ++n)
+		columns |= pt->flags;
 	seg->src = src;
 	seg->next = NULL;
-	slist_init(&seg->points);
+	seg->points_cnt = n;
+	seg->columns = columns;
+	seg->bands_cnt = 0;
+	seg->bands = NULL;
+	seg->boxes = NULL;
+	seg->loc = new_column(gpx, n, sizeof(*seg->loc), 1);
+	seg->merc = new_column(gpx, n, sizeof(*seg->merc), 1);
+	seg->time = new_column(gpx, n, sizeof(*seg->time), columns & GPX_PT_TIME);
+	seg->flags = new_column(gpx, n, sizeof(*seg->flags), 1);
+	seg->speed = new_column(gpx, n, sizeof(*seg->speed), columns & GPX_PT_SPEED);
+	seg->ele = new_column(gpx, n, sizeof(*seg->ele), columns & GPX_PT_ELE);
+	seg->hdop = new_column(gpx, n, sizeof(*seg->hdop), columns & GPX_PT_HDOP);
+	seg->vdop = new_column(gpx, n, sizeof(*seg->vdop), columns & GPX_PT_VDOP);
+	seg->pdop = new_column(gpx, n, sizeof(*seg->pdop), columns & GPX_PT_PDOP);
+
+	for (i = 0, pt = points; pt; pt = pt->next, ++i) {
+		unsigned flags = pt->flags;
+
+		seg->loc[i] = pt->loc;
+		if (seg->time)
+			seg->time[i] = flags & GPX_PT_TIME ? pt->time : 0;
+		seg->flags[i] = flags;
+		if (seg->speed)
+			seg->speed[i] = flags & GPX_PT_SPEED ? pt->speed : 0.0;
+		if (seg->ele)
+			seg->ele[i] = flags & GPX_PT_ELE ? pt->ele : 0.0;
+		if (seg->hdop)
+			seg->hdop[i] = flags & GPX_PT_HDOP ? pt->hdop : 0.0;
+		if (seg->vdop)
+			seg->vdop[i] = flags & GPX_PT_VDOP ? pt->vdop : 0.0;
+		if (seg->pdop)
+			seg->pdop[i] = flags & GPX_PT_PDOP ? pt->pdop : 0.0;
+	}
+	merc_project(seg->merc, &seg->loc->lat, n);
 	return seg;
 }
 
-void free_trk_segment(struct gpx_segment *seg)
+void put_trk_segment(struct gpx_data *gpx, struct gpx_segment *seg)
 {
-	if (!seg)
-		return;
-	while (seg->points.head)
-		free_trk_point(slist_pop(&seg->points));
-	if (seg->free_src)
-		free((char *)seg->src);
-	free(seg);
+	slist_append(&gpx->segments, seg);
 }
 
-void put_trk_segment(struct gpx_data *gpx, struct gpx_segment *seg)
+/* the pixel of the point in the whole map, with 256x256 tiles */
+#define band_pixel(seg, i, shift) \
+	((uint64_t)((seg)->merc[i].x >> (shift)) << 32 | (seg)->merc[i].y >> (shift))
+
+/*
+ * Keeps the points of the coarser band, which start or end a run on one
+ * pixel of zoom z. As the pixels of z are made of those of the finer
+ * zooms, the band drawn at any zoom up to z gives the image of all points.
+ */
+static void simplify_band(struct gpx_data *gpx, const struct gpx_segment *seg,
+			  const struct gpx_band *fine, struct gpx_band *band)
 {
-	slist_append(&gpx->segments, seg);
+	const int shift = 24 - band->z;
+	const int n = fine->points_cnt;
+	int k, pass, cnt = 0;
+
+#define band_idx(k) (fine->idx ? fine->idx[k] : (k))
+	/* counts the points first, then stores them */
+	for (pass = 0; pass < 2; ++pass) {
+		uint64_t ppix = 0, pix = 0, npix;
+
+		if (n)
+			pix = band_pixel(seg, band_idx(0), shift);
+		for (k = 0, cnt = 0; k < n; ++k) {
+			npix = k + 1 < n ? band_pixel(seg, band_idx(k + 1), shift) : pix;
+			if (k == 0 || k == n - 1 || pix != ppix || pix != npix) {
+				if (pass)
+					band->idx[cnt] = band_idx(k);
+				++cnt;
+			}
+			ppix = pix;
+			pix = npix;
+		}
+		if (cnt == n) {
+			band->idx = fine->idx;
+			break;
+		}
+		if (!pass)
+			band->idx = arena_alloc(&gpx->arena, cnt * sizeof(*band->idx));
+	}
+#undef band_idx
+	band->points_cnt = cnt;
 }
 
-static void process_wpt(struct gpx_data *gpx, xmlNode *xe)
+void gpx_simplify(struct gpx_data *gpx, const int *zooms, int n)
 {
-	char *err, *nptr;
-	struct gpx_point *pt;
+	struct gpx_segment *seg;
 
-	pt = new_trk_point();
-	nptr = ASCII xmlGetProp(xe, BAD_CAST "lat");
-	pt->loc.lat = strtod(nptr, &err);
-	xmlFree(nptr);
-	if ((pt->loc.lat == 0.0 && nptr == err) || pt->loc.lat == HUGE_VAL)
-		goto fail;
-	nptr = ASCII xmlGetProp(xe, BAD_CAST "lon");
-	pt->loc.lon = strtod(nptr, &err);
-	xmlFree(nptr);
-	if ((pt->loc.lon == 0.0 && nptr == err) || pt->loc.lon == HUGE_VAL)
-		goto fail;
-	pt->flags |= GPX_PT_LATLON;
-	parse_trkpt(xe, pt, NULL);
-	if (!(pt->flags & GPX_PT_TIME))
-		pt->time[0] = '\0';
-	slist_append(&gpx->wpts, pt);
+	slist_for_each(seg, &gpx->segments) {
+		struct gpx_band all = {
+			.points_cnt = seg->points_cnt,
+			.idx = NULL,
+		};
+		int b;
+
+		seg->bands = arena_alloc(&gpx->arena, n * sizeof(*seg->bands));
+		seg->bands_cnt = n;
+		for (b = 0; b < n; ++b) {
+			seg->bands[b].z = zooms[b];
+			simplify_band(gpx, seg, b ? seg->bands + b - 1 : &all,
+				      seg->bands + b);
+		}
+	}
+}
+
+void gpx_box(struct gpx_data *gpx)
+{
+	struct gpx_segment *seg;
+
+	slist_for_each(seg, &gpx->segments) {
+		const int n = (seg->points_cnt + GPX_BOX_POINTS - 1) / GPX_BOX_POINTS;
+		struct gpx_box *box = NULL;
+		int i;
+
+		seg->boxes = n ? arena_alloc(&gpx->arena, n * sizeof(*seg->boxes)) : NULL;
+		for (i = 0; i < seg->points_cnt; ++i) {
+			const struct merc *m = seg->merc + i;
+
+			if (i % GPX_BOX_POINTS == 0) {
+				box = seg->boxes + i / GPX_BOX_POINTS;
+				box->min = box->max = *m;
+				continue;
+			}
+			if (box->min.x > m->x)
+				box->min.x = m->x;
+			if (box->max.x < m->x)
+				box->max.x = m->x;
+			if (box->min.y > m->y)
+				box->min.y = m->y;
+			if (box->max.y < m->y)
+				box->max.y = m->y;
+		}
+	}
+}
+
+/*
+ * The waypoints are few: they are kept in the arena of the file until they
+ * are all read and packed into gpx->wpts by end_wpts().
+ */
+static void init_wpts(struct segtab_entry *wpts)
+{
+	wpts->src = (char *)GPX_SRC_WAYPOINT;
+	slist_init(&wpts->points);
+}
+
+static void put_wpt(struct gpx_data *gpx, struct segtab_entry *wpts,
+		    struct gpx_point *pt)
+{
+	slist_append(&wpts->points, pt);
 	gpx->points_cnt++;
-	return;
-fail:
-	free_trk_point(pt);
 }
 
-static void free_wpt(struct gpx_point *pt)
+static void end_wpts(struct gpx_data *gpx, struct segtab_entry *wpts)
 {
-	if (!pt)
+	if (!slist_empty(&wpts->points))
+		gpx->wpts = new_trk_segment(gpx, wpts->src, wpts->points.head);
+}
+
+static void process_wpt(struct gpx_data *gpx, struct segtab_entry *wpts,
+			xmlNode *xe)
+{
+	xmlChar *lat, *lon;
+	struct gpx_point *pt;
+	int err;
+
+	pt = new_trk_point(&gpx->arena);
+	lat = xmlGetProp(xe, BAD_CAST "lat");
+	lon = xmlGetProp(xe, BAD_CAST "lon");
+	err = parse_coord(lat, &pt->loc.lat) || parse_coord(lon, &pt->loc.lon);
+	xmlFree(lat);
+	xmlFree(lon);
+	if (err) {
+		free_trk_point(&gpx->arena, pt);
 		return;
-	free_trk_point(pt);
+	}
+	pt->flags |= GPX_PT_LATLON;
+	parse_trkpt(xe, pt, NULL);
+	put_wpt(gpx, wpts, pt);
 }
 
-struct gpx_data *gpx_read_file(const char *path)
+#define GPX_XML_OPTIONS (XML_PARSE_RECOVER | \
+			 XML_PARSE_NOERROR | \
+			 XML_PARSE_NOWARNING | \
+			 XML_PARSE_NONET | \
+			 XML_PARSE_NOXINCNODE)
+
+enum gpx_parser gpx_parser = GPX_PARSER_STREAM;
+int gpx_parse_threads = 1;
+
+/* in is the compressed input of the file, NULL to read it as is */
+static void gpx_read_dom(struct gpx_data *gpx, struct gpx_input *in)
 {
+	struct segtab_entry wpts;
 	xmlNode *xe;
 	xmlDoc *xml;
-	struct gpx_data *gpx = malloc(sizeof(*gpx));
-
-	gpx->path = strdup(path);
-	gpx->points_cnt = 0;
-	slist_init(&gpx->segments);
-	slist_init(&gpx->wpts);
-	memset(gpx->time, 0, sizeof(gpx->time));
 
-	xml = xmlReadFile(gpx->path,
-			  NULL /* encoding */,
-			  XML_PARSE_RECOVER |
-			  XML_PARSE_NOERROR |
-			  XML_PARSE_NOWARNING |
-			  XML_PARSE_NONET |
-			  XML_PARSE_NOXINCNODE);
+	if (in)
+		xml = xmlReadIO(gpx_input_read, gpx_input_close, in, gpx->path,
+				NULL /* encoding */, GPX_XML_OPTIONS);
+	else
+		xml = xmlReadFile(gpx->path, NULL /* encoding */, GPX_XML_OPTIONS);
 	if (!xml)
-		return gpx;
+		return;
 
+	init_wpts(&wpts);
 	for (xe = xmlFirstElementChild(xmlDocGetRootElement(xml)); xe;
 	     xe = xmlNextElementSibling(xe)) {
 		xmlNode *seg;
@@ -474,7 +851,7 @@ struct gpx_data *gpx_read_file(const char *path)
 			continue;
 		}
 		if (xmlStrcasecmp(xe->name, BAD_CAST "wpt") == 0) {
-			process_wpt(gpx, xe);
+			process_wpt(gpx, &wpts, xe);
 			continue;
 		}
 		if (xmlStrcasecmp(xe->name, BAD_CAST "trk") != 0)
@@ -487,20 +864,779 @@ struct gpx_data *gpx_read_file(const char *path)
 				xmlFirstElementChild(seg));
 		}
 	}
+	end_wpts(gpx, &wpts);
 	xmlFreeDoc(xml);
+}
+
+/*
+ * The reader (and its dictionary of element names) is reused for all the
+ * files a loader thread reads, see gpx_thread_cleanup().
+ */
+static __thread xmlTextReaderPtr gpx_reader;
+
+/* State of the streaming parser */
+struct gpx_stream
+{
+	struct gpx_data *gpx;
+	struct trkseg ts;
+	struct gpx_point *pt; /* <trkpt> or <wpt> being read */
+	struct segtab_entry *src;
+	struct segtab_entry wpts;
+	const xmlChar *field; /* element which text is expected */
+	char text[128];
+	int text_len;
+	int field_depth, pt_depth;
+	unsigned in_trk:1, in_trkseg:1, pt_is_wpt:1;
+};
+
+static const xmlChar *reader_attr(xmlTextReaderPtr r, const char *name)
+{
+	if (xmlTextReaderMoveToAttribute(r, BAD_CAST name) != 1)
+		return NULL;
+	return xmlTextReaderConstValue(r);
+}
+
+/* the waypoints are kept until the end of the file, the points of the
+ * segments until the end of the <trkseg> */
+static struct arena *point_arena(struct gpx_data *gpx, int wpt)
+{
+	return wpt ? &gpx->arena : &gpx_scratch;
+}
+
+static struct gpx_point *reader_point(struct arena *arena, xmlTextReaderPtr r)
+{
+	struct gpx_point *pt = new_trk_point(arena);
+	int err;
+
+	/* parse one attribute before looking up the other: the value may be
+	 * in a buffer of the reader */
+	err = parse_coord(reader_attr(r, "lat"), &pt->loc.lat) ||
+		parse_coord(reader_attr(r, "lon"), &pt->loc.lon);
+	xmlTextReaderMoveToElement(r);
+	if (err) {
+		free_trk_point(arena, pt);
+		return NULL;
+	}
+	return pt;
+}
+
+/* Consumes the point, NULL if its coordinates could not be parsed */
+static void stream_point(struct gpx_stream *st, struct gpx_point *pt,
+			 int depth, int wpt)
+{
+	st->pt = pt;
+	st->pt_depth = depth;
+	st->pt_is_wpt = wpt;
+	st->src = NULL;
+	if (pt)
+		pt->flags |= GPX_PT_LATLON;
+}
+
+/* the text of a field is cut to the size of st->text */
+static void stream_append(struct gpx_stream *st, const char *s, size_t l)
+{
+	if (l > sizeof(st->text) - 1 - st->text_len)
+		l = sizeof(st->text) - 1 - st->text_len;
+	memcpy(st->text + st->text_len, s, l);
+	st->text_len += l;
+}
+
+static void stream_text(struct gpx_stream *st, const xmlChar *s)
+{
+	stream_append(st, ASCII s, strlen(ASCII s));
+}
+
+/* end of the element which text was collected */
+static void stream_field(struct gpx_stream *st)
+{
+	st->text[st->text_len] = '\0';
+	if (st->pt) {
+		struct segtab_entry *e;
+
+		e = parse_trkpt_field(st->pt, st->field, BAD_CAST st->text,
+				      st->pt_is_wpt ? NULL : &st->ts.segs);
+		if (e)
+			st->src = e;
+	} else
+		xmlCharCopy(st->gpx->time, sizeof(st->gpx->time), BAD_CAST st->text);
+	st->field = NULL;
+	st->text_len = 0;
+}
+
+#define STREAM_TRKPT 1
+#define STREAM_WPT 2
+
+/*
+ * The name must stay valid until the element is closed.
+ * Returns STREAM_TRKPT or STREAM_WPT if the element starts a point, which
+ * must then be passed to stream_point().
+ */
+static int stream_element(struct gpx_stream *st, const xmlChar *name, int depth)
+{
+	if (st->pt && depth == st->pt_depth + 1) {
+		st->field = name;
+		st->field_depth = depth;
+		return 0;
+	}
+	switch (depth) {
+	case 1:
+		if (xmlStrcasecmp(name, BAD_CAST "time") == 0) {
+			st->field = name;
+			st->field_depth = depth;
+		} else if (xmlStrcasecmp(name, BAD_CAST "wpt") == 0)
+			return STREAM_WPT;
+		else if (xmlStrcasecmp(name, BAD_CAST "trk") == 0)
+			st->in_trk = 1;
+		break;
+	case 2:
+		if (st->in_trk && xmlStrcasecmp(name, BAD_CAST "trkseg") == 0) {
+			trkseg_begin(&st->ts, st->gpx);
+			st->in_trkseg = 1;
+		}
+		break;
+	case 3:
+		if (!st->in_trkseg)
+			break;
+		if (xmlStrcasecmp(name, BAD_CAST "trkpt") == 0)
+			return STREAM_TRKPT;
+		fprintf(stderr, "Unknown element %s\n", name);
+		break;
+	}
+	return 0;
+}
+
+static void stream_end(struct gpx_stream *st, int depth)
+{
+	if (st->field && depth == st->field_depth)
+		stream_field(st);
+	if (depth == st->pt_depth) {
+		if (st->pt) {
+			if (st->pt_is_wpt)
+				put_wpt(st->gpx, &st->wpts, st->pt);
+			else
+				trkseg_put_point(&st->ts, st->pt, st->src);
+		}
+		st->pt = NULL;
+		st->pt_depth = -1;
+	} else if (depth == 2 && st->in_trkseg) {
+		st->gpx->points_cnt += trkseg_end(st->gpx, &st->ts);
+		st->in_trkseg = 0;
+	} else if (depth == 1)
+		st->in_trk = 0;
+}
+
+/* in is the compressed input of the file, NULL to read it as is */
+static void gpx_read_stream(struct gpx_data *gpx, struct gpx_input *in)
+{
+	struct gpx_stream st = { .gpx = gpx, .pt_depth = -1 };
+	xmlTextReaderPtr r = gpx_reader;
+
+	init_wpts(&st.wpts);
+	/* the reader closes the input, even if it fails */
+	if (in && !r)
+		r = gpx_reader = xmlReaderForIO(gpx_input_read, gpx_input_close, in,
+						gpx->path, NULL, GPX_XML_OPTIONS);
+	else if (in && xmlReaderNewIO(r, gpx_input_read, gpx_input_close, in,
+				      gpx->path, NULL, GPX_XML_OPTIONS) < 0)
+		r = NULL;
+	else if (!in && !r)
+		r = gpx_reader = xmlReaderForFile(gpx->path, NULL, GPX_XML_OPTIONS);
+	else if (!in && xmlReaderNewFile(r, gpx->path, NULL, GPX_XML_OPTIONS) < 0)
+		r = NULL;
+	if (!r)
+		return;
+	while (xmlTextReaderRead(r) == 1) {
+		int depth = xmlTextReaderDepth(r);
+
+		switch (xmlTextReaderNodeType(r)) {
+			int empty, pt;
+		case XML_READER_TYPE_ELEMENT:
+			empty = xmlTextReaderIsEmptyElement(r);
+			pt = stream_element(&st, xmlTextReaderConstLocalName(r), depth);
+			if (pt)
+				stream_point(&st, reader_point(point_arena(gpx, pt == STREAM_WPT), r),
+					     depth, pt == STREAM_WPT);
+			if (empty)
+				stream_end(&st, depth);
+			break;
+		case XML_READER_TYPE_END_ELEMENT:
+			stream_end(&st, depth);
+			break;
+		case XML_READER_TYPE_TEXT:
+		case XML_READER_TYPE_CDATA:
+			if (st.field && depth == st.field_depth + 1)
+				stream_text(&st, xmlTextReaderConstValue(r));
+			break;
+		}
+	}
+	/* broken file: keep what could be read */
+	if (st.pt)
+		free_trk_point(point_arena(gpx, st.pt_is_wpt), st.pt);
+	if (st.in_trkseg)
+		gpx->points_cnt += trkseg_end(gpx, &st.ts);
+	end_wpts(gpx, &st.wpts);
+}
+
+/*
+ * Fast path for machine-written GPX: a minimal XML tokenizer scanning the
+ * mmapped file in place. Anything it does not understand (entities other
+ * than the predefined ones and the character references, CDATA, DTDs,
+ * encodings other than UTF-8, broken nesting) makes it give up and the file
+ * is then read by libxml2. The text of the elements it does not use is
+ * skipped, whatever it holds.
+ */
+#define FAST_MAX_DEPTH (32)
+#define FAST_MAX_NAME (48)
+#define FAST_MAX_VALUE (64)
+
+/* copy a value to be parsed, if it does not need any XML processing */
+static int fast_value(char *buf, size_t size, const char *s, size_t len)
+{
+	if (len >= size || memchr(s, '&', len))
+		return -1;
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	return 0;
+}
+
+/* the UTF-8 of a predefined entity or a character reference, its length */
+static int fast_entity(char *utf8, const char *s, size_t len)
+{
+	static const struct { const char *name; char c; } entities[] = {
+		{ "amp", '&' }, { "lt", '<' }, { "gt", '>' },
+		{ "quot", '"' }, { "apos", '\'' },
+	};
+	unsigned long c;
+	char *e;
+	size_t i;
+
+	for (i = 0; i < countof(entities); ++i)
+		if (strlen(entities[i].name) == len &&
+		    memcmp(entities[i].name, s, len) == 0) {
+			*utf8 = entities[i].c;
+			return 1;
+		}
+	if (len < 2 || *s != '#')
+		return -1;
+	if (s[1] == 'x')
+		c = strtoul(s + 2, &e, 16);
+	else
+		c = strtoul(s + 1, &e, 10);
+	if (e != s + len || !c || c > 0x10ffff)
+		return -1;
+	if (c < 0x80) {
+		utf8[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		utf8[0] = 0xc0 | c >> 6;
+		utf8[1] = 0x80 | (c & 0x3f);
+		return 2;
+	}
+	if (c < 0x10000) {
+		utf8[0] = 0xe0 | c >> 12;
+		utf8[1] = 0x80 | (c >> 6 & 0x3f);
+		utf8[2] = 0x80 | (c & 0x3f);
+		return 3;
+	}
+	utf8[0] = 0xf0 | c >> 18;
+	utf8[1] = 0x80 | (c >> 12 & 0x3f);
+	utf8[2] = 0x80 | (c >> 6 & 0x3f);
+	utf8[3] = 0x80 | (c & 0x3f);
+	return 4;
+}
+
+/* the text of the field, with its entities decoded */
+static int fast_text(struct gpx_stream *st, const char *s, const char *end)
+{
+	while (s < end) {
+		const char *amp = memchr(s, '&', end - s), *semi;
+		char utf8[4];
+		int l;
+
+		stream_append(st, s, (amp ? amp : end) - s);
+		if (!amp)
+			break;
+		semi = memchr(amp, ';', end - amp);
+		if (!semi || (l = fast_entity(utf8, amp + 1, semi - amp - 1)) < 0)
+			return -1;
+		stream_append(st, utf8, l);
+		s = semi + 1;
+	}
+	return 0;
+}
+
+static int fast_xmldecl(const char *p, const char *end)
+{
+	const char *enc = memmem(p, end - p, "encoding", 8);
+	const char *q;
+
+	if (!enc)
+		return 0;
+	enc += 8;
+	while (enc < end && (isspace((unsigned char)*enc) || *enc == '='))
+		++enc;
+	if (enc == end || (*enc != '"' && *enc != '\''))
+		return -1;
+	q = memchr(enc + 1, *enc, end - enc - 1);
+	if (!q)
+		return -1;
+	++enc;
+	if ((q - enc == 5 && strncasecmp(enc, "utf-8", 5) == 0) ||
+	    (q - enc == 8 && strncasecmp(enc, "us-ascii", 8) == 0))
+		return 0;
+	return -1;
+}
+
+/*
+ * Parses the attributes of a start tag up to and including its ">", picking
+ * the values of "lat" and "lon". Returns the end of the tag or NULL.
+ */
+static const char *fast_attrs(const char *p, const char *end,
+			      char *lat, char *lon, int *empty)
+{
+	*lat = *lon = '\0';
+	while (p < end) {
+		const char *n, *q;
+		size_t nlen;
+
+		if (isspace((unsigned char)*p)) {
+			++p;
+			continue;
+		}
+		if (*p == '>') {
+			*empty = 0;
+			return p + 1;
+		}
+		if (*p == '/') {
+			*empty = 1;
+			return p + 1 < end && p[1] == '>' ? p + 2 : NULL;
+		}
+		for (n = p; p < end && *p != '=' && !isspace((unsigned char)*p); ++p)
+			if (*p == '>' || *p == '/')
+				return NULL;
+		nlen = p - n;
+		while (p < end && isspace((unsigned char)*p))
+			++p;
+		if (p == end || *p != '=')
+			return NULL;
+		for (++p; p < end && isspace((unsigned char)*p); ++p)
+			;
+		if (p == end || (*p != '"' && *p != '\''))
+			return NULL;
+		q = memchr(p + 1, *p, end - p - 1);
+		if (!q)
+			return NULL;
+		++p;
+		if (nlen == 3 && memcmp(n, "lat", 3) == 0) {
+			if (fast_value(lat, FAST_MAX_VALUE, p, q - p))
+				return NULL;
+		} else if (nlen == 3 && memcmp(n, "lon", 3) == 0) {
+			if (fast_value(lon, FAST_MAX_VALUE, p, q - p))
+				return NULL;
+		}
+		p = q + 1;
+	}
+	return NULL;
+}
+
+/*
+ * Big files are split on <trkseg> and the chunks are parsed in parallel.
+ * The chunks but the first start inside <gpx><trk>: the names of these
+ * elements are only known once the previous chunks are parsed, they are
+ * checked by fast_stitch(). A split inside a comment, a processing
+ * instruction or an attribute leaves the previous chunk unterminated, and
+ * it fails.
+ */
+#define FAST_CHUNK_MIN (16u << 20)
+#define FAST_MAX_CHUNKS (64)
+#define FAST_INHERITED (2)
+
+struct fast_chunk
+{
+	struct gpx_data *gpx; /* the file, or data of the chunk */
+	struct gpx_data data;
+	struct gpx_stream st;
+	const char *p, *end;
+	pthread_t thr;
+	int thr_started, ret;
+
+	char names[FAST_MAX_DEPTH][FAST_MAX_NAME]; /* of the open elements */
+	int depth;
+	unsigned inherited; /* bits of the depths opened before the chunk */
+	unsigned closed; /* bits of the inherited depths which were closed */
+	char closed_names[FAST_INHERITED][FAST_MAX_NAME];
+};
+
+static int fast_parse(struct fast_chunk *c)
+{
+	struct gpx_stream *st = &c->st;
+	const char *p = c->p, *end = c->end;
+	char buf[FAST_MAX_VALUE], lon[FAST_MAX_VALUE];
+
+	if (end - p >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+		p += 3;
+	while (p < end && isspace((unsigned char)*p))
+		++p;
+	if (p == end || *p != '<')
+		return -1;
+	while (p < end) {
+		const char *lt = memchr(p, '<', end - p), *n;
+		size_t nlen;
+		int empty, pt;
+
+		if (!lt)
+			break;
+		if (st->field && c->depth == st->field_depth + 1 && lt > p &&
+		    (!st->pt || trkpt_field_used(st->field)) &&
+		    fast_text(st, p, lt))
+			return -1;
+		p = lt + 1;
+		if (p == end)
+			return -1;
+		switch (*p) {
+		case '?':
+			lt = memmem(p, end - p, "?>", 2);
+			if (!lt)
+				return -1;
+			if (end - p > 4 && memcmp(p, "?xml", 4) == 0 &&
+			    fast_xmldecl(p + 4, lt))
+				return -1;
+			p = lt + 2;
+			continue;
+		case '!':
+			/* comments only, no CDATA or DTD */
+			if (end - p < 3 || p[1] != '-' || p[2] != '-')
+				return -1;
+			lt = memmem(p + 3, end - p - 3, "-->", 3);
+			if (!lt)
+				return -1;
+			p = lt + 3;
+			continue;
+		case '/':
+			for (n = ++p; p < end && *p != '>' && !isspace((unsigned char)*p); ++p)
+				if (*p == ':')
+					n = p + 1;
+			nlen = p - n;
+			p = memchr(p, '>', end - p);
+			if (!p || !c->depth--)
+				return -1;
+			if (c->inherited & (1u << c->depth)) {
+				c->inherited &= ~(1u << c->depth);
+				c->closed |= 1u << c->depth;
+				if (fast_value(c->closed_names[c->depth],
+					       FAST_MAX_NAME, n, nlen))
+					return -1;
+			} else if (strlen(c->names[c->depth]) != nlen ||
+				   memcmp(c->names[c->depth], n, nlen))
+				return -1;
+			stream_end(st, c->depth);
+			++p;
+			continue;
+		}
+		for (n = p; p < end && *p != '>' && *p != '/' &&
+			    !isspace((unsigned char)*p); ++p)
+			if (*p == ':')
+				n = p + 1;
+		nlen = p - n;
+		if (c->depth == FAST_MAX_DEPTH || !nlen ||
+		    fast_value(c->names[c->depth], FAST_MAX_NAME, n, nlen))
+			return -1;
+		p = fast_attrs(p, end, buf, lon, &empty);
+		if (!p)
+			return -1;
+		pt = stream_element(st, BAD_CAST c->names[c->depth], c->depth);
+		if (pt) {
+			struct arena *arena = point_arena(st->gpx, pt == STREAM_WPT);
+			struct gpx_point *gpt = new_trk_point(arena);
+
+			if (parse_coord(BAD_CAST buf, &gpt->loc.lat) ||
+			    parse_coord(BAD_CAST lon, &gpt->loc.lon)) {
+				free_trk_point(arena, gpt);
+				gpt = NULL;
+			}
+			stream_point(st, gpt, c->depth, pt == STREAM_WPT);
+		}
+		if (empty)
+			stream_end(st, c->depth);
+		else
+			++c->depth;
+	}
+	return 0;
+}
+
+static void gpx_clear(struct gpx_data *gpx)
+{
+	arena_release(&gpx->arena);
+	slist_init(&gpx->segments);
+	gpx->wpts = NULL;
+	gpx->points_cnt = 0;
+	memset(gpx->time, 0, sizeof(gpx->time));
+}
+
+static void fast_chunk_init(struct fast_chunk *c, struct gpx_data *gpx,
+			    const char *p, const char *end, int first)
+{
+	c->p = p;
+	c->end = end;
+	c->thr_started = 0;
+	c->ret = -1;
+	c->closed = 0;
+	if (first) {
+		c->gpx = gpx;
+		c->depth = 0;
+		c->inherited = 0;
+	} else {
+		c->gpx = &c->data;
+		c->data.path = gpx->path;
+		arena_init(&c->data.arena);
+		slist_init(&c->data.segments);
+		c->data.wpts = NULL;
+		c->data.points_cnt = 0;
+		memset(c->data.time, 0, sizeof(c->data.time));
+		/* <gpx><trk> */
+		c->depth = FAST_INHERITED;
+		c->inherited = (1u << FAST_INHERITED) - 1;
+	}
+	memset(&c->st, 0, sizeof(c->st));
+	c->st.gpx = c->gpx;
+	c->st.pt_depth = -1;
+	c->st.in_trk = !!c->depth;
+	init_wpts(&c->st.wpts);
+}
+
+static void *fast_chunk_parse(void *arg)
+{
+	struct fast_chunk *c = arg;
+	struct gpx_stream *st = &c->st;
+
+	c->ret = fast_parse(c);
+	if (st->pt)
+		free_trk_point(point_arena(c->gpx, st->pt_is_wpt), st->pt);
+	if (st->in_trkseg) {
+		/* the chunks end before a <trkseg> */
+		trkseg_end(c->gpx, &st->ts);
+		c->ret = -1;
+	}
+	return NULL;
+}
+
+static void *fast_chunk_thread(void *arg)
+{
+	fast_chunk_parse(arg);
+	gpx_thread_cleanup();
+	return NULL;
+}
+
+/* the next <trkseg> start tag, with or without a namespace prefix */
+static const char *fast_trkseg(const char *map, const char *p, const char *end)
+{
+	const char *q, *lt;
+
+	for (;; p = q + 6) {
+		q = memmem(p, end - p, "trkseg", 6);
+		if (!q || q + 6 == end)
+			return NULL;
+		if (q[6] != '>' && q[6] != '/' && !isspace((unsigned char)q[6]))
+			continue;
+		lt = q - 1;
+		if (lt > map && *lt == ':')
+			for (--lt; lt > map && (isalnum((unsigned char)*lt) || *lt == '_' ||
+						*lt == '-' || *lt == '.'); --lt)
+				;
+		if (lt >= map && *lt == '<')
+			return lt;
+	}
+}
+
+/* the starts of the chunks, at <trkseg> as close as possible to equal sizes */
+static int fast_split(const char *map, size_t size, const char **starts, int n)
+{
+	int i, cnt = 1;
+
+	starts[0] = map;
+	for (i = 1; i < n; ++i) {
+		const char *p = map + size / n * i;
+
+		if (p <= starts[cnt - 1])
+			p = starts[cnt - 1] + 1;
+		p = fast_trkseg(map, p, map + size);
+		if (!p)
+			break;
+		starts[cnt++] = p;
+	}
+	return cnt;
+}
+
+/* the elements open at a split, as fast_chunk_init() assumes them */
+static int fast_inherited(char names[FAST_INHERITED][FAST_MAX_NAME])
+{
+	return strcasecmp(names[0], "gpx") == 0 &&
+		strcasecmp(names[1], "trk") == 0;
+}
+
+/*
+ * Checks that the chunks follow each other, each one starting inside
+ * <gpx><trk>, and appends their segments and waypoints to the first one,
+ * in the order of the file.
+ */
+static int fast_stitch(struct fast_chunk *chunks, int cnt)
+{
+	struct fast_chunk *first = chunks;
+	char names[FAST_INHERITED][FAST_MAX_NAME];
+	int i, d;
+
+	if (first->ret || (cnt > 1 && first->depth != FAST_INHERITED))
+		return -1;
+	for (d = 0; d < FAST_INHERITED; ++d)
+		strcpy(names[d], first->names[d]);
+	for (i = 1; i < cnt; ++i) {
+		struct fast_chunk *c = chunks + i;
+
+		if (c->ret || c->depth != (i == cnt - 1 ? 0 : FAST_INHERITED) ||
+		    !fast_inherited(names))
+			return -1;
+		for (d = 0; d < FAST_INHERITED; ++d) {
+			if ((c->closed & (1u << d)) &&
+			    strcmp(c->closed_names[d], names[d]))
+				return -1;
+			if (!(c->inherited & (1u << d)))
+				strcpy(names[d], c->names[d]);
+		}
+	}
+	if (cnt == 1 && first->depth)
+		return -1;
+	for (i = 1; i < cnt; ++i) {
+		struct fast_chunk *c = chunks + i;
+
+		slist_splice(&first->gpx->segments, &c->data.segments);
+		slist_splice(&first->st.wpts.points, &c->st.wpts.points);
+		first->gpx->points_cnt += c->data.points_cnt;
+		if (!first->gpx->time[0])
+			memcpy(first->gpx->time, c->data.time, sizeof(c->data.time));
+		arena_merge(&first->gpx->arena, &c->data.arena);
+	}
+	end_wpts(first->gpx, &first->st.wpts);
+	return 0;
+}
+
+static int gpx_read_fast(struct gpx_data *gpx)
+{
+	struct fast_chunk *chunks;
+	const char *starts[FAST_MAX_CHUNKS];
+	struct stat stat;
+	char *map;
+	int fd, i, cnt, ret;
+
+	fd = open(gpx->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &stat) < 0 || !stat.st_size) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	madvise(map, stat.st_size, MADV_SEQUENTIAL);
+
+	cnt = stat.st_size / FAST_CHUNK_MIN;
+	if (cnt > gpx_parse_threads)
+		cnt = gpx_parse_threads;
+	if (cnt > FAST_MAX_CHUNKS)
+		cnt = FAST_MAX_CHUNKS;
+	cnt = fast_split(map, stat.st_size, starts, cnt < 1 ? 1 : cnt);
+again:
+	chunks = malloc(cnt * sizeof(*chunks));
+	for (i = 0; i < cnt; ++i)
+		fast_chunk_init(chunks + i, gpx, starts[i],
+				i + 1 < cnt ? starts[i + 1] : map + stat.st_size,
+				i == 0);
+	for (i = 1; i < cnt; ++i)
+		if (pthread_create(&chunks[i].thr, NULL, fast_chunk_thread, chunks + i))
+			fast_chunk_parse(chunks + i);
+		else
+			chunks[i].thr_started = 1;
+	fast_chunk_parse(chunks);
+	for (i = 1; i < cnt; ++i)
+		if (chunks[i].thr_started)
+			pthread_join(chunks[i].thr, NULL);
+
+	ret = fast_stitch(chunks, cnt);
+	for (i = 1; i < cnt; ++i)
+		arena_release(&chunks[i].data.arena);
+	free(chunks);
+	if (ret) {
+		gpx_clear(gpx);
+		/* split in a comment, or at a <trkseg> outside of <trk>? */
+		if (cnt > 1) {
+			cnt = 1;
+			goto again;
+		}
+	}
+	munmap(map, stat.st_size);
+	return ret;
+}
+
+struct gpx_data *gpx_alloc(const char *path)
+{
+	struct gpx_data *gpx = malloc(sizeof(*gpx));
+
+	gpx->path = strdup(path);
+	arena_init(&gpx->arena);
+	gpx->map = NULL;
+	gpx->map_size = 0;
+	gpx->points_cnt = 0;
+	gpx->track_cnt = 0;
+	slist_init(&gpx->segments);
+	gpx->wpts = NULL;
+	memset(gpx->time, 0, sizeof(gpx->time));
+	return gpx;
+}
+
+struct gpx_data *gpx_read_file(const char *path)
+{
+	extern int verbose;
+	struct gpx_data *gpx = gpx_alloc(path);
+	/* the compressed files are only read by libxml2 */
+	struct gpx_input *in = gpx_input_open(path);
+
+	switch (gpx_parser) {
+	case GPX_PARSER_FAST:
+		if (!in && gpx_read_fast(gpx) == 0)
+			break;
+		if (!in && verbose > 0)
+			fprintf(stderr, "%s: not understood by the fast parser\n",
+				gpx->path);
+		/* fall through */
+	case GPX_PARSER_STREAM:
+		gpx_read_stream(gpx, in);
+		break;
+	case GPX_PARSER_DOM:
+		gpx_read_dom(gpx, in);
+		break;
+	}
 	return gpx;
 }
 
 void gpx_free(struct gpx_data *gpx)
 {
-	while (gpx->segments.head)
-		free_trk_segment(slist_pop(&gpx->segments));
-	while (gpx->wpts.head)
-		free_wpt(slist_pop(&gpx->wpts));
+	gpx_clear(gpx);
+	if (gpx->map)
+		munmap(gpx->map, gpx->map_size);
 	free(gpx->path);
 	free(gpx);
 }
 
+/* to be called by the threads which used gpx_read_file() */
+void gpx_thread_cleanup(void)
+{
+	xmlFreeTextReader(gpx_reader);
+	gpx_reader = NULL;
+	arena_release(&gpx_scratch);
+}
+
 /* for valgrind */
 void gpx_libxml_cleanup(void)
 {
@@ -1,13 +1,16 @@
 #ifndef _GPX_H_
 #define _GPX_H_
 
+#include <stdint.h>
+#include "arena.h"
+#include "slippy-map.h"
+
 struct gpx_latlon
 {
 	double lat, lon;
 };
 
 struct gpx_segment;
-struct gpx_point;
 
 struct gpx_data
 {
@@ -15,17 +18,55 @@ struct gpx_data
 	char time[24];
 
 	struct { struct gpx_segment *head, **tail; } segments;
-	struct { struct gpx_point *head, **tail; } wpts;
+	struct gpx_segment *wpts; /* NULL if there are none */
 	int points_cnt, track_cnt;
+	struct arena arena; /* segments, their points and sources */
+	void *map; /* cache file the columns are in, see gpx-cache.c */
+	size_t map_size;
 };
 
+/*
+ * The points of a segment are stored by columns, points_cnt entries each,
+ * so that the renderer walks them sequentially. The optional columns are
+ * only allocated if one of the points has the value, see columns.
+ */
 struct gpx_segment
 {
 	struct gpx_segment *next;
 	const char *src;
-	unsigned free_src:1;
+	int points_cnt;
+	unsigned columns; /* GPX_PT_* of all the points */
+
+	struct gpx_latlon *loc;
+	struct merc *merc; /* loc, projected */
+	int64_t *time; /* milliseconds since the epoch, optional */
+	uint16_t *flags; /* GPX_PT_* of the point */
+	float *speed, *ele, *hdop, *vdop, *pdop; /* optional */
+
+	/* see gpx_simplify(), by decreasing zoom */
+	int bands_cnt;
+	struct gpx_band *bands;
+	/* see gpx_box(), NULL if not computed */
+	struct gpx_box *boxes;
+};
 
-	struct { struct gpx_point *head, **tail; } points;
+/*
+ * The points of a segment which are enough to draw it at zoom levels up to
+ * z: of the consecutive points falling on the same pixel only the first
+ * and the last are kept. Indexes into the columns, NULL if all of them.
+ */
+struct gpx_band
+{
+	int z;
+	int points_cnt;
+	int *idx;
+};
+
+/* The bounding box of GPX_BOX_POINTS consecutive points of a segment */
+#define GPX_BOX_POINTS (256)
+struct gpx_box
+{
+	struct merc min, max;
 };
 
 #define GPX_PT_LATLON  (1 << 0)
@@ -38,6 +79,7 @@ struct gpx_segment
 #define GPX_PT_SAT     (1 << 7)
 #define GPX_PT_TIME    (1 << 8)
 
+/* A point while being parsed, before it is packed into its segment */
 struct gpx_point
 {
 	struct gpx_point *next;
@@ -46,15 +88,10 @@ struct gpx_point
 	struct gpx_latlon loc;
 	double speed;
 	int sat;
-	float ele, geoidheight;
+	float ele;
 	float course;
 	float hdop, vdop, pdop;
-
-	char time[24];
-	// struct gpx_data *container;
-	// struct gpx_segment *seg;
-	// struct gpx_track *trk;
-	//int trk, seg;
+	int64_t time; /* milliseconds since the epoch */
 };
 
 extern const char GPX_SRC_GPS[];
@@ -62,17 +99,35 @@ extern const char GPX_SRC_NETWORK[];
 extern const char GPX_SRC_WAYPOINT[];
 extern const char GPX_SRC_UNKNOWN[];
 
-struct gpx_point *new_trk_point(void);
-void free_trk_point(struct gpx_point *);
-void put_trk_point(struct gpx_segment *, struct gpx_point *);
+struct gpx_point *new_trk_point(struct arena *);
+void free_trk_point(struct arena *, struct gpx_point *);
 
-struct gpx_segment *new_trk_segment(const char *src);
-void free_trk_segment(struct gpx_segment *);
+struct gpx_segment *new_trk_segment(struct gpx_data *, const char *src,
+				    const struct gpx_point *points);
 void put_trk_segment(struct gpx_data *, struct gpx_segment *);
 
+/* Computes the bands of the track segments, zooms is in decreasing order */
+void gpx_simplify(struct gpx_data *, const int *zooms, int n);
+/* Computes the boxes of the track segments */
+void gpx_box(struct gpx_data *);
+
+enum gpx_parser
+{
+	GPX_PARSER_STREAM, /* xmlTextReader, points are taken as they are read */
+	GPX_PARSER_DOM, /* the whole document is read into memory first */
+	GPX_PARSER_FAST, /* mmap and tokenize in place, else GPX_PARSER_STREAM */
+};
+extern enum gpx_parser gpx_parser;
+/* GPX_PARSER_FAST parses the big files with up to that many threads */
+extern int gpx_parse_threads;
+
+char *gpx_format_time(char *buf, size_t size, int64_t ms);
+
+struct gpx_data *gpx_alloc(const char *path);
 struct gpx_data *gpx_read_file(const char *path);
 void gpx_free(struct gpx_data *);
 
+void gpx_thread_cleanup(void);
 void gpx_libxml_cleanup(void);
 
 #endif /* _GPX_H_ */
@@ -16,10 +16,14 @@
 #include <sys/wait.h>
 #include <gd.h>
 #include <gdfonts.h>
+#include <zlib.h>
 #include "slist.h"
 #include "gpx.h"
+#include "gpx-cache.h"
+#include "gpx-spill.h"
 #include "tstime.h"
 #include "slippy-map.h"
+#include "tile-png.h"
 #include "rgbhsv.h"
 
 #define countof(a) (sizeof(a) / sizeof((a)[0]))
@@ -38,11 +42,59 @@
 #define ZOOM_MAX (19)
 
 static int zoom_min = 1, zoom_max = 18;
+/* the zooms below zoom_draw are reduced from it, see make_pyramid() */
+static int pyramid, zoom_draw = 1;
 
 extern int verbose;
 int verbose;
 
 static int reinitialize; /* don't update the tiles, redraw them from scratch */
+static int one_pass; /* draw all the zoom levels of a shard at once */
+static int stream; /* draw the files while they are being loaded */
+static const char *spill_dir; /* keep the points there, not in memory */
+static int bin_tiles; /* record the drawing in the tiles, see draw_bins() */
+
+/*
+ * The bytes of the tile images, of the parsed points and of the queues, of
+ * all the threads. Over the limit, the tiles are flushed as soon as they
+ * are unused, see close_tile(), and with -s the loaders wait.
+ */
+static long memory_limit; /* --memory-limit, 0 if none */
+static long memory_used, memory_peak;
+/* of memory_used, the images and hits of the tiles, and those queued to PNG */
+static long memory_tiles, memory_queued;
+static int memory_warned;
+
+static void memory_account(long bytes)
+{
+	long used = __atomic_add_fetch(&memory_used, bytes, __ATOMIC_RELAXED);
+	long peak = __atomic_load_n(&memory_peak, __ATOMIC_RELAXED);
+
+	while (used > peak &&
+	       !__atomic_compare_exchange_n(&memory_peak, &peak, used, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void memory_account_tile(long bytes)
+{
+	__atomic_add_fetch(&memory_tiles, bytes, __ATOMIC_RELAXED);
+	memory_account(bytes);
+}
+
+static inline int memory_over(void)
+{
+	return memory_limit &&
+		__atomic_load_n(&memory_used, __ATOMIC_RELAXED) > memory_limit;
+}
+
+/* not counting the tiles already queued, they are freed once written */
+static inline int memory_over_unqueued(void)
+{
+	return memory_limit &&
+		__atomic_load_n(&memory_used, __ATOMIC_RELAXED) -
+		__atomic_load_n(&memory_queued, __ATOMIC_RELAXED) > memory_limit;
+}
 
 #define SHADOW (0xc0c0c0)
 static int drop_shadows; /* draw diagnostic shadows */
@@ -64,8 +116,17 @@ static double no_lines_speed = 1.0; /* kph */
 
 static int set_speed = INT_MIN;
 
+/* the segments are drawn with fewer points up to these zooms, see gpx.h */
+static const int simplify_zooms[] = { 12, 9, 6, 3 };
+static int simplify_bands[countof(simplify_zooms)];
+static int simplify_cnt;
+static int estimate_costs; /* of the tile jobs, for more than one thread */
+
 #define TILE_W (256)
 #define TILE_H (256)
+/* a true color gdImage, and the hits of the heatmap */
+#define TILE_IMG_BYTES ((long)TILE_H * (TILE_W * sizeof(int) + sizeof(int *)))
+#define TILE_HITS_BYTES ((long)TILE_W * TILE_H * sizeof(uint16_t))
 
 static int fixclr = 0; /* used if set_speed == INT_MAX */
 
@@ -104,122 +165,161 @@ static inline gdPoint xy2gdPoint(const struct xy xy)
 	return (gdPoint){ .x = xy.x, .y = xy.y };
 }
 
-static inline struct xy get_tile_xy(const struct gpx_latlon *loc, int zoom)
-{
-	struct xy tile;
-
-	tile.x = long2tilex(loc->lon, zoom);
-	tile.y = lat2tiley(loc->lat, zoom);
-
-	// gpx2png.pl uses this:
-	// map latitude/longitude and zoom level to tile number (x/y)
-	// see also: https://wiki.openstreetmap.org/wiki/Slippy_map_tilenames
-	// tile.x = int( ( loc->lon + 180. ) / 360. * ( 1 << zoom ) );
-	// double l  = log( tan( loc->lat * M_PI / 180 ) + sec( loc->lat * M_PI / 180 ) );
-	// tile.y = int( ( 1 - l / M_PI ) / 2 * ( 1 << zoom ) );
-	return tile;
-}
-
-static inline double ProjectMercToLat(double merc_lat)
+static inline struct xy get_tile_xy(const struct merc *m, int zoom)
 {
-    return 180.0 / M_PI * atan(sinh(merc_lat));
-}
-
-struct projection
-{
-	double s, w, n, e;
-};
-
-static struct projection Project(struct xy xy, int z)
-{
-    double unit = 1.0 / pow(2.0, z);
-    double relY1 = xy.y * unit;
-    double relY2 = relY1 + unit;
-
-// note: $LimitY = ProjectF(degrees(atan(sinh(pi)))) = log(sinh(pi)+cosh(pi)) = pi
-// note: degrees(atan(sinh(pi))) = 85.051128..
-//my $LimitY = ProjectF(85.0511);
-
-    // so stay simple and more accurate
-    double limitY = M_PI;
-    double rangeY = 2 * limitY;
-    relY1 = limitY - rangeY * relY1;
-    relY2 = limitY - rangeY * relY2;
-    double lat1 = ProjectMercToLat(relY1);
-    double lat2 = ProjectMercToLat(relY2);
-    unit = 360.0 / pow(2.0, z);
-    double long1 = -180.0 + xy.x * unit;
-    return (struct projection){ .s = lat2, .w = long1, .n = lat1, .e = long1 + unit };
+	return (struct xy){
+		.x = merc2tile(m->x, zoom),
+		.y = merc2tile(m->y, zoom),
+	};
 }
 
-// From gpx2png.pl:
-// determine pixel position for a coordinate relative to the tileimage
-// where it is drawn on
-static struct xy getPixelPosForCoordinates(const struct gpx_latlon *loc,
-					   int z)
+/* pixel position of a point relative to the tile image it is drawn on */
+static inline struct xy getPixelPosForCoordinates(const struct merc *m, int z)
 {
-	struct projection proj = Project(get_tile_xy(loc, z), z);
-
 	return (struct xy){
-		.x = (loc->lon - proj.w) * TILE_W /  (proj.e - proj.w),
-		.y = (loc->lat - proj.n) * TILE_H / (proj.s - proj.n),
+		.x = merc2pixel(m->x, z),
+		.y = merc2pixel(m->y, z),
 	};
 }
 
 struct gpx_file
 {
 	struct gpx_file *next;
-	struct gpx_data *gpx;
+	struct gpx_data *gpx; /* NULL after spill_file() */
+	int no, points_cnt;
+	int loaded, readers; /* -s, see stream_tiles() */
+	/* counted by the loader, for the costs of the tile jobs */
+	unsigned long points[ZOOM_MAX + 1], tiles[ZOOM_MAX + 1];
+	double line_len; /* in merc units, along the longer axis */
 };
 
+/* in the order of the command line */
+static SLIST_DEFINE(struct gpx_file, gpx_files);
+
 struct tile {
 	struct tile *next;
 	int refcnt;
+	int pending; /* PNGs being written, see flush_tile() */
 	struct xy xy;
 	struct gpx_latlon loc;
 	int point_cnt;
 	unsigned has_speed:1;
+	unsigned lru:1, evicted:1, read:1;
+	/* of the image read from its PNG, see flush_tile() */
+	uint64_t read_hash;
+	/* in the LRU of the zoom level while it is open and unused */
+	struct tile *lru_prev, *lru_next;
 	gdImage *img;
+	uint16_t *hits; /* of the pixels, in the heatmap mode */
+	struct tile_op *ops; /* -B, until draw_bins() */
+	int ops_cnt, ops_size;
 };
 
-#define ZOOM_TILE_HASH_SIZE (256u)
+/*
+ * The tiles of a zoom level are in an open addressing table, with linear
+ * probing, indexed by the hash of the Morton code of their x/y. It is kept
+ * at most 3/4 full; the tiles are only removed all at once.
+ */
+#define ZOOM_TILES_MIN_BITS (8u)
 struct zoom_level {
-	SLIST_STACK_DECLARE(struct tile, tiles[ZOOM_TILE_HASH_SIZE]);
+	struct tile **tiles;
+	unsigned tiles_bits; /* log2 of the size of the table, 0 if none */
+	struct tile *last; /* found */
+	/* the tiles close_tile() can flush, the least recently used first */
+	struct tile *lru_first, *lru_last;
 	double xunit, yunit;
 	int tile_cnt, image_cnt;
+	unsigned long lookups, probes;
+	unsigned long evictions, reloads, unchanged;
 };
 
-static struct zoom_level *zoom_levels; /* goes from 0 to zoom_max */
+/* goes from 0 to zoom_max, each thread draws in its own */
+static __thread struct zoom_level *zoom_levels;
+/* the thread draws only the tiles of its shard, see tile_shard() */
+static __thread int shard, shards = 1;
+/* the tiles are not opened, their drawing is recorded, see tile_draw() */
+static __thread int binning;
+
+#define zoom_level_size(zl) ((zl)->tiles ? 1u << (zl)->tiles_bits : 0u)
+#define zoom_level_for_each(tile, zl, i) \
+	for ((i) = 0; (i) < zoom_level_size(zl); ++(i)) \
+		if (((tile) = (zl)->tiles[i]))
+
+static inline uint64_t morton_spread(uint32_t v)
+{
+	uint64_t m = v;
+
+	m = (m | m << 16) & 0x0000ffff0000ffffull;
+	m = (m | m << 8) & 0x00ff00ff00ff00ffull;
+	m = (m | m << 4) & 0x0f0f0f0f0f0f0f0full;
+	m = (m | m << 2) & 0x3333333333333333ull;
+	m = (m | m << 1) & 0x5555555555555555ull;
+	return m;
+}
 
-static inline unsigned hash_xy(const struct xy *xy)
+static inline unsigned tile_slot(const struct zoom_level *zl, const struct xy *xy)
 {
-	return ((xy->y << 3) | (xy->x & 0x7)) % ZOOM_TILE_HASH_SIZE;
+	uint64_t key = morton_spread(xy->x) | morton_spread(xy->y) << 1;
+
+	/* Fibonacci hashing, the top bits are the best mixed */
+	return (key * 0x9e3779b97f4a7c15ull) >> (64 - zl->tiles_bits);
 }
 
 static struct tile *find_tile(const struct xy *xy, int zoom)
 {
+	struct zoom_level *zl;
 	struct tile *tile;
+	unsigned i, mask;
 
 	if (zoom < zoom_min || zoom > zoom_max)
 		return NULL;
-	unsigned h = hash_xy(xy);
-	struct tile **prev = &zoom_levels[zoom].tiles[h].head;
-	slist_for_each(tile, &zoom_levels[zoom].tiles[h]) {
+	zl = zoom_levels + zoom;
+	tile = zl->last;
+	if (tile && tile->xy.x == xy->x && tile->xy.y == xy->y)
+		return tile;
+	if (!zl->tiles)
+		return NULL;
+	mask = zoom_level_size(zl) - 1;
+	zl->lookups++;
+	for (i = tile_slot(zl, xy); (tile = zl->tiles[i]); i = (i + 1) & mask) {
+		zl->probes++;
 		if (tile->xy.x == xy->x && tile->xy.y == xy->y) {
-			*prev = tile->next;
-			tile->next = zoom_levels[zoom].tiles[h].head;
-			zoom_levels[zoom].tiles[h].head = tile;
+			zl->last = tile;
 			break;
 		}
-		prev = &tile->next;
 	}
 	return tile;
 }
 
+static void insert_tile(struct zoom_level *zl, struct tile *tile)
+{
+	unsigned i, mask = zoom_level_size(zl) - 1;
+
+	for (i = tile_slot(zl, &tile->xy); zl->tiles[i]; i = (i + 1) & mask)
+		;
+	zl->tiles[i] = tile;
+}
+
+static void grow_zoom_level(struct zoom_level *zl)
+{
+	struct tile **old = zl->tiles;
+	unsigned i, old_size = zoom_level_size(zl);
+
+	zl->tiles_bits = old ? zl->tiles_bits + 1 : ZOOM_TILES_MIN_BITS;
+	zl->tiles = calloc(1u << zl->tiles_bits, sizeof(*zl->tiles));
+	for (i = 0; i < old_size; ++i)
+		if (old[i])
+			insert_tile(zl, old[i]);
+	free(old);
+}
+
 static pthread_mutex_t free_tiles_lock = PTHREAD_MUTEX_INITIALIZER;
 static SLIST_STACK_DEFINE(struct tile, free_tiles);
 #define GD_ANTIALIAS_COLOR (gdTrueColorAlpha(0, 255, 0, 0))
 
+/* -C, the paths of the tiles are relative to it */
+static int tiles_dir = AT_FDCWD;
+
 static char *get_tile_png_path(char *path, size_t maxlen, const struct xy *xy, int z)
 {
 	snprintf(path, maxlen, "%d/%d/%d.png", z, xy->x, xy->y);
@@ -231,20 +331,18 @@ static struct tile *alloc_tile(const struct xy *xy, int z)
 	struct tile *tile = NULL;
 
 	if (zoom_min <= z && z <= zoom_max) {
-		const int transparent = gdTrueColorAlpha(0, 0, 0, gdAlphaTransparent);
-		unsigned h = hash_xy(xy);
-	
+		struct zoom_level *zl = zoom_levels + z;
+
 		pthread_mutex_lock(&free_tiles_lock);
 		if (!free_tiles.head) {
 			tile = malloc(sizeof(*tile));
 			tile->img = NULL;
+			tile->hits = NULL;
+			tile->pending = 0;
+			tile->ops = NULL;
+			tile->ops_cnt = tile->ops_size = 0;
 		} else {
 			tile = slist_stack_pop(&free_tiles);
-			if (tile->img) {
-				gdImageFilledRectangle(tile->img, 0, 0, TILE_W, TILE_H, 0);
-				gdImageFilledRectangle(tile->img, 0, 0, TILE_W, TILE_H, transparent);
-				zoom_levels[z].image_cnt++;
-			}
 		}
 		pthread_mutex_unlock(&free_tiles_lock);
 		tile->has_speed = 0;
@@ -253,11 +351,18 @@ static struct tile *alloc_tile(const struct xy *xy, int z)
 		tile->loc.lon = tilex2long(xy->x, z);
 		tile->point_cnt = 0;
 		tile->refcnt = 0;
-		slist_push(&zoom_levels[z].tiles[h], tile);
-		zoom_levels[z].tile_cnt++;
+		tile->lru = tile->evicted = tile->read = 0;
+		tile->lru_prev = tile->lru_next = NULL;
+		if ((zl->tile_cnt + 1) * 4u > zoom_level_size(zl) * 3u)
+			grow_zoom_level(zl);
+		insert_tile(zl, tile);
+		zl->last = tile;
+		zl->tile_cnt++;
 	}
 	return tile;
 }
+
+/* once saved, its image and hits are already released by flush_tile() */
 static void free_tile(struct tile *tile)
 {
 	pthread_mutex_lock(&free_tiles_lock);
@@ -265,37 +370,421 @@ static void free_tile(struct tile *tile)
 	pthread_mutex_unlock(&free_tiles_lock);
 }
 
+/*
+ * The tiles are spread over the shards by ranges of the Morton code of their
+ * position, of about as many tiles each, see shard_ranges(), so that a shard
+ * can skip the points of a segment far from its range, see shard_box().
+ * Without an estimate of the tiles, by the hash of their position.
+ */
+static uint64_t *shard_bounds[ZOOM_MAX + 1]; /* the first keys of shards 1.. */
+
+static inline uint64_t tile_key(uint32_t x, uint32_t y)
+{
+	return morton_spread(x) | morton_spread(y) << 1;
+}
+
+static inline int tile_shard(const struct xy *xy, int z)
+{
+	const uint64_t key = tile_key(xy->x, xy->y), *b = shard_bounds[z];
+	int lo = 0, hi = shards - 1;
+
+	if (!b)
+		return (key * 0x9e3779b97f4a7c15ull >> 32) % shards;
+	/* the number of bounds up to the key */
+	while (lo < hi) {
+		const int mid = (lo + hi) / 2;
+
+		if (b[mid] <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * If the points of the box can draw into a tile of the shard, with the line
+ * from the tile pxy before them and the circles on the neighbour tiles. The
+ * keys of the tiles of a rectangle are between those of its corners.
+ */
+static int shard_box(const struct gpx_box *box, const struct xy *pxy, int z)
+{
+	const uint64_t *b = shard_bounds[z];
+	int x0 = merc2tile(box->min.x, z), x1 = merc2tile(box->max.x, z);
+	int y0 = merc2tile(box->min.y, z), y1 = merc2tile(box->max.y, z);
+
+	if (!b)
+		return 1;
+	if (pxy) {
+		x0 = min(x0, pxy->x);
+		x1 = max(x1, pxy->x);
+		y0 = min(y0, pxy->y);
+		y1 = max(y1, pxy->y);
+	}
+	if (--x0 < 0 || --y0 < 0)
+		return 1;
+	return (shard == 0 || tile_key(x1 + 1, y1 + 1) >= b[shard - 1]) &&
+		(shard == shards - 1 || tile_key(x0, y0) < b[shard]);
+}
+
+/* NULL if the tile belongs to another shard */
 static struct tile *get_tile_at(const struct xy *xy, int z)
 {
-	struct tile *tile = find_tile(xy, z);
+	struct tile *tile;
 
+	if (shards > 1 && tile_shard(xy, z) != shard)
+		return NULL;
+	tile = find_tile(xy, z);
 	if (!tile)
 		tile = alloc_tile(xy, z);
 	return tile;
 }
 
+static inline int pixel_empty(int c)
+{
+	return !c || gdTrueColorGetAlpha(c) == gdAlphaTransparent;
+}
+
+/*
+ * The heatmap counts the points on each pixel of a tile, and colors them
+ * only in flush_tile(): n points get heatmapclr intensified n - 1 times,
+ * see prepare_heat_lut(), so the result does not depend on their order.
+ */
+#define HEAT_LUT_SIZE (64)
+static int heat_lut[HEAT_LUT_SIZE];
+static int heat_lut_max; /* more hits get its color */
+
+/*
+ * The hits of a pixel of an existing tile, by its color. The other colors,
+ * as those of the shadows, are no hits.
+ */
+static unsigned heat_hits(int c)
+{
+	int i;
+
+	if (pixel_empty(c))
+		return 0;
+	c &= 0xffffff;
+	for (i = 1; i <= heat_lut_max; ++i)
+		if (heat_lut[i] == c)
+			return i;
+	return 0;
+}
+
+/* the pixels of the image with the colors of hits are counted, and cleared */
+static void heat_load(struct tile *tile)
+{
+	int x, y;
+
+	if (!tile->hits) {
+		tile->hits = malloc(TILE_HITS_BYTES);
+		memory_account_tile(TILE_HITS_BYTES);
+	}
+	for (y = 0; y < TILE_H; ++y)
+		for (x = 0; x < TILE_W; ++x) {
+			int *c = &gdImageTrueColorPixel(tile->img, x, y);
+			uint16_t *h = tile->hits + y * TILE_W + x;
+
+			*h = heat_hits(*c);
+			if (*h)
+				*c = 0;
+		}
+}
+
+static void heat_paint(struct tile *tile)
+{
+	int x, y;
+
+	for (y = 0; y < TILE_H; ++y)
+		for (x = 0; x < TILE_W; ++x) {
+			unsigned h = tile->hits[y * TILE_W + x];
+
+			if (h)
+				gdImageTrueColorPixel(tile->img, x, y) =
+					heat_lut[min(h, (unsigned)heat_lut_max)];
+		}
+}
+
+static inline void heat_add(struct tile *tile, int x, int y)
+{
+	uint16_t *h;
+
+	if (x < 0 || x >= TILE_W || y < 0 || y >= TILE_H)
+		return;
+	h = tile->hits + y * TILE_W + x;
+	if (*h < UINT16_MAX)
+		++*h;
+}
+
+static void lru_add(struct zoom_level *zl, struct tile *tile)
+{
+	tile->lru_prev = zl->lru_last;
+	tile->lru_next = NULL;
+	if (zl->lru_last)
+		zl->lru_last->lru_next = tile;
+	else
+		zl->lru_first = tile;
+	zl->lru_last = tile;
+	tile->lru = 1;
+}
+
+static void lru_del(struct zoom_level *zl, struct tile *tile)
+{
+	if (tile->lru_prev)
+		tile->lru_prev->lru_next = tile->lru_next;
+	else
+		zl->lru_first = tile->lru_next;
+	if (tile->lru_next)
+		tile->lru_next->lru_prev = tile->lru_prev;
+	else
+		zl->lru_last = tile->lru_prev;
+	tile->lru_prev = tile->lru_next = NULL;
+	tile->lru = 0;
+}
+
+/*
+ * The flushed tiles are compressed and written by a pool of threads, from a
+ * bounded queue: the drawing threads wait for room in it. A tile with its
+ * PNG still pending is not read back before it is written.
+ */
+#define PNG_QUEUE (4) /* per writer */
+
+struct png_job
+{
+	struct png_job *next;
+	struct tile *tile;
+	gdImage *img;
+	struct xy xy;
+	int z;
+};
+
+static pthread_mutex_t png_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t png_cond = PTHREAD_COND_INITIALIZER; /* to write */
+static pthread_cond_t png_room_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t png_done_cond = PTHREAD_COND_INITIALIZER;
+static SLIST_DEFINE(struct png_job, png_q);
+static int png_queued, png_queue_max, png_end;
+static pthread_t *png_writers;
+static int png_writers_cnt;
+static int zoom_saved[ZOOM_MAX + 1]; /* a tile of the zoom was written */
+
+static void write_png(const struct png_job *job)
+{
+	const int oflags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	char path[PATH_MAX], *p;
+	FILE *fp = NULL;
+	int fd, err;
+
+	get_tile_png_path(path, sizeof(path), &job->xy, job->z);
+	strcat(path, ".tmp");
+	fd = openat(tiles_dir, path, oflags, 0666);
+	if (fd < 0) {
+		p = strchr(path, '/');
+		*p = '\0';
+		mkdirat(tiles_dir, path, 0775);
+		*p = '/';
+		p = strchr(p + 1, '/');
+		*p = '\0';
+		mkdirat(tiles_dir, path, 0775);
+		*p = '/';
+		fd = openat(tiles_dir, path, oflags, 0666);
+	}
+	if (fd >= 0 && !(fp = fdopen(fd, "wb")))
+		close(fd);
+	if (!fp) {
+		perror(path);
+		return;
+	}
+	err = tile_png_write(job->img, fp);
+	if (err > 0)
+		gdImagePngEx(job->img, fp, tile_png_level);
+	if (err < 0 || ferror(fp)) {
+		fprintf(stderr, "%s: failed to write the PNG\n", path);
+		err = -1;
+	}
+	if (fclose(fp) && err >= 0) {
+		perror(path);
+		err = -1;
+	}
+	/* the old tile is kept, rather than replaced by a truncated one */
+	if (err < 0) {
+		unlinkat(tiles_dir, path, 0);
+		return;
+	}
+	p = strdup(path);
+	path[strlen(path) - 4] = '\0';
+	if (renameat(tiles_dir, p, tiles_dir, path) < 0)
+		perror(p);
+	else
+		__atomic_store_n(&zoom_saved[job->z], 1, __ATOMIC_RELAXED);
+	free(p);
+}
+
+static void *png_writer(void *arg)
+{
+	struct png_job *job;
+
+	pthread_mutex_lock(&png_lock);
+	while (1) {
+		if (slist_empty(&png_q)) {
+			if (png_end)
+				break;
+			pthread_cond_wait(&png_cond, &png_lock);
+			continue;
+		}
+		job = slist_pop(&png_q);
+		png_queued--;
+		pthread_cond_signal(&png_room_cond);
+		pthread_mutex_unlock(&png_lock);
+
+		write_png(job);
+		gdImageDestroy(job->img);
+		memory_account_tile(-TILE_IMG_BYTES);
+		__atomic_sub_fetch(&memory_queued, TILE_IMG_BYTES, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&png_lock);
+		job->tile->pending--;
+		pthread_cond_broadcast(&png_done_cond);
+		free(job);
+	}
+	pthread_mutex_unlock(&png_lock);
+	return NULL;
+}
+
+static void start_png_writers(int writers)
+{
+	png_writers = calloc(writers, sizeof(*png_writers));
+	png_queue_max = PNG_QUEUE * writers;
+	png_end = 0;
+	for (png_writers_cnt = 0; png_writers_cnt < writers; ++png_writers_cnt)
+		if (pthread_create(png_writers + png_writers_cnt, NULL,
+				   png_writer, NULL)) {
+			perror("pthread_create");
+			break;
+		}
+	if (!png_writers_cnt)
+		exit(1);
+}
+
+/* once all the tiles are flushed */
+static void join_png_writers(void)
+{
+	int i;
+
+	pthread_mutex_lock(&png_lock);
+	png_end = 1;
+	pthread_cond_broadcast(&png_cond);
+	pthread_mutex_unlock(&png_lock);
+	for (i = 0; i < png_writers_cnt; ++i)
+		pthread_join(png_writers[i], NULL);
+	free(png_writers);
+	png_writers = NULL;
+	png_writers_cnt = 0;
+}
+
+static void wait_png(struct tile *tile)
+{
+	pthread_mutex_lock(&png_lock);
+	while (tile->pending)
+		pthread_cond_wait(&png_done_cond, &png_lock);
+	pthread_mutex_unlock(&png_lock);
+}
+
+/*
+ * Of the RGB of the pixels, all that is written of them. A pixel changes
+ * the hash on its own for certain, as each step is a bijection.
+ */
+static uint64_t tile_img_hash(gdImage *img)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	int x, y;
+
+	for (y = 0; y < TILE_H; ++y)
+		for (x = 0; x < TILE_W; ++x)
+			h = (h ^ (gdImageTrueColorPixel(img, x, y) & 0xffffff)) *
+				0x100000001b3ull;
+	return h;
+}
+
+/* not written if its pixels are those read from its PNG */
+static void flush_tile(struct tile *tile, int z, int verbosity)
+{
+	struct png_job *job;
+
+	if (tile->lru)
+		lru_del(zoom_levels + z, tile);
+	if (tile->hits) {
+		heat_paint(tile);
+		free(tile->hits);
+		tile->hits = NULL;
+		memory_account_tile(-TILE_HITS_BYTES);
+	}
+	zoom_levels[z].image_cnt--;
+	if (verbosity > 1)
+		printf("z %d %d/%d (%d)\n", z,
+		       tile->xy.x, tile->xy.y, tile->point_cnt);
+	if (tile->read && tile_img_hash(tile->img) == tile->read_hash) {
+		gdImageDestroy(tile->img);
+		tile->img = NULL;
+		memory_account_tile(-TILE_IMG_BYTES);
+		zoom_levels[z].unchanged++;
+		return;
+	}
+	job = malloc(sizeof(*job));
+	job->tile = tile;
+	job->img = tile->img;
+	job->xy = tile->xy;
+	job->z = z;
+	tile->img = NULL;
+
+	pthread_mutex_lock(&png_lock);
+	while (png_queued >= png_queue_max)
+		pthread_cond_wait(&png_room_cond, &png_lock);
+	tile->pending++;
+	png_queued++;
+	__atomic_add_fetch(&memory_queued, TILE_IMG_BYTES, __ATOMIC_RELAXED);
+	slist_append(&png_q, job);
+	pthread_cond_signal(&png_cond);
+	pthread_mutex_unlock(&png_lock);
+}
+
 static struct tile *open_tile(struct tile *tile, int z)
 {
+	if (tile->lru)
+		lru_del(zoom_levels + z, tile);
 	tile->refcnt++;
-	if (tile->img)
+	if (tile->img || binning)
 		return tile;
 
 	const int transparent = gdTrueColorAlpha(0, 0, 0, gdAlphaTransparent);
-	FILE *fp;
+	FILE *fp = NULL;
 	char path[128];
+	int fd;
 
+	if (__atomic_load_n(&tile->pending, __ATOMIC_ACQUIRE))
+		wait_png(tile);
+	tile->read = 0;
 	get_tile_png_path(path, sizeof(path), &tile->xy, z);
-	fp = fopen(path, "rb");
+	fd = openat(tiles_dir, path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0 && !(fp = fdopen(fd, "rb")))
+		close(fd);
 	if (fp) {
 		tile->img = gdImageCreateFromPng(fp);
+		if (tile->img)
+			tile->img = tile_png_truecolor(tile->img);
 		if (tile->img) {
 			gdImageColorTransparent(tile->img, transparent);
+			tile->read = 1;
+			tile->read_hash = tile_img_hash(tile->img);
 			zoom_levels[z].image_cnt++;
+			zoom_levels[z].reloads += tile->evicted;
+			memory_account_tile(TILE_IMG_BYTES);
 		}
 		fclose(fp);
 	}
 	if (!tile->img) {
 		tile->img = gdImageCreateTrueColor(TILE_W, TILE_H);
+		memory_account_tile(TILE_IMG_BYTES);
 		gdImageColorTransparent(tile->img, transparent);
 		gdImageFilledRectangle(tile->img, -1, -1, TILE_W, TILE_H, transparent);
 		if (drop_shadows) {
@@ -304,47 +793,24 @@ static struct tile *open_tile(struct tile *tile, int z)
 		}
 		zoom_levels[z].image_cnt++;
 	}
+	if (z_no_lines == HEATMAP_MODE)
+		heat_load(tile);
 	gdImageSetAntiAliased(tile->img, GD_ANTIALIAS_COLOR);
 	gdImageSetThickness(tile->img, z <= ZOOM_MAX ? z_thickness[z] : 1);
 	return tile;
 }
 
-static void flush_tile(struct tile *tile, int z, int verbosity)
+/* once, flushing the tiles cannot help with the rest */
+static void memory_warn(void)
 {
-	char path[PATH_MAX], *p;
-	FILE *fp;
-
-	get_tile_png_path(path, sizeof(path), &tile->xy, z);
-	strcat(path, ".tmp");
-	fp = fopen(path, "wb");
-	if (!fp) {
-		p = strchr(path, '/');
-		*p = '\0';
-		mkdir(path, 0775);
-		*p = '/';
-		p = strchr(p + 1, '/');
-		*p = '\0';
-		mkdir(path, 0775);
-		*p = '/';
-		fp = fopen(path, "wb");
-	}
-	if (!fp)
-		perror(path);
-	else {
-		gdImagePngEx(tile->img, fp, 4);
-		fclose(fp);
-		gdImageDestroy(tile->img);
-		tile->img = NULL;
-		zoom_levels[z].image_cnt--;
-		if (verbosity > 1)
-			printf("z %d %d/%d (%d)\n", z,
-			       tile->xy.x, tile->xy.y, tile->point_cnt);
-	}
-	p = strdup(path);
-	path[strlen(path) - 4] = '\0';
-	if (rename(p, path) < 0)
-		perror(p);
-	free(p);
+	long rest = __atomic_load_n(&memory_used, __ATOMIC_RELAXED) -
+		__atomic_load_n(&memory_tiles, __ATOMIC_RELAXED);
+
+	if (rest > memory_limit &&
+	    !__atomic_exchange_n(&memory_warned, 1, __ATOMIC_RELAXED))
+		fprintf(stderr, "%ld MB of points and queues, over the memory limit "
+			"of %ld MB without any tile, see -s and -O\n",
+			(rest + (1 << 20) - 1) >> 20, memory_limit >> 20);
 }
 
 static void close_tile(struct tile *tile, int z)
@@ -354,30 +820,27 @@ static void close_tile(struct tile *tile, int z)
 		abort();
 	}
 
-	unsigned int h;
-	int need = zoom_levels[z].image_cnt - z_max_tiles;
-
-	while (need > 0) {
-		int flushed = 0;
-
-		for (h = 0; h < ZOOM_TILE_HASH_SIZE; ++h) {
-			struct tile *last = NULL;
+	struct zoom_level *zl = zoom_levels + z;
+	int need;
 
-			slist_for_each(tile, &zoom_levels[z].tiles[h])
-				if (tile->img && tile->refcnt == 0)
-					last = tile;
-			if (last) {
-				flush_tile(last, z, verbose);
-				++flushed;
-				if (--need <= 0)
-					break;
-			}
-		}
-		if (!flushed) {
-			fprintf(stderr, "z %d: %d needed\n", z, need);
-			break;
-		}
+	if (tile->refcnt == 0 && tile->img)
+		lru_add(zl, tile);
+	/*
+	 * The least recently used ones, keeping at least one over the limit.
+	 * The tiles queued to PNG are as good as freed, the queue is bounded.
+	 */
+	while (zl->lru_first && (zl->image_cnt > z_max_tiles ||
+				 (zl->image_cnt > 1 && memory_over_unqueued()))) {
+		tile = zl->lru_first;
+		flush_tile(tile, z, verbose);
+		tile->evicted = 1;
+		zl->evictions++;
 	}
+	if (memory_over() && !__atomic_load_n(&memory_warned, __ATOMIC_RELAXED))
+		memory_warn();
+	need = zl->image_cnt - z_max_tiles;
+	if (need > 0)
+		fprintf(stderr, "z %d: %d needed\n", z, need);
 }
 
 static void prepare_zoom_levels(void)
@@ -394,22 +857,30 @@ static void prepare_zoom_levels(void)
 static void free_zoom_level(int z)
 {
 	struct zoom_level *zl = zoom_levels + z;
-	unsigned int h;
+	struct tile *tile;
+	unsigned i;
 
 	if (verbose > 1)
-		printf("tile counts at zoom %d: %u\n", z, zoom_levels[z].tile_cnt);
+		printf("tile counts at zoom %d: %u (table %u, %lu lookups, "
+		       "%.2f probes each)\n", z, zl->tile_cnt,
+		       zoom_level_size(zl), zl->lookups,
+		       zl->lookups ? (double)zl->probes / zl->lookups : 0.0);
+	if (verbose > 0 && zl->evictions)
+		fprintf(stderr, "z %d: %lu tiles evicted, reloaded %lu times\n",
+			z, zl->evictions, zl->reloads);
+	if (verbose > 0 && zl->unchanged)
+		fprintf(stderr, "z %d: %lu tiles unchanged, not written\n",
+			z, zl->unchanged);
+	zoom_level_for_each(tile, zl, i)
+		free_tile(tile);
+	free(zl->tiles);
+	zl->tiles = NULL;
+	zl->tiles_bits = 0;
+	zl->last = NULL;
+	zl->lru_first = zl->lru_last = NULL;
 	zl->tile_cnt = 0;
-	for (h = 0; h < ZOOM_TILE_HASH_SIZE; ++h) {
-		int hl = 0;
-		while (zl->tiles[h].head) {
-			free_tile(slist_stack_pop(&zl->tiles[h]));
-			++hl;
-		}
-		if (verbose > 1)
-			printf(" %d", hl);
-	}
-	if (verbose > 1)
-		printf("\n");
+	zl->lookups = zl->probes = 0;
+	zl->evictions = zl->reloads = zl->unchanged = 0;
 }
 
 #define XY(_x, _y) (struct xy){.x = _x, .y = _y}
@@ -467,6 +938,20 @@ static int intensify(int c, double step)
 			   (int)(rgb.b * 255.));
 }
 
+static void prepare_heat_lut(void)
+{
+	int n;
+
+	heat_lut[0] = 0;
+	heat_lut[1] = heatmapclr;
+	for (n = 2; n < HEAT_LUT_SIZE; ++n) {
+		heat_lut[n] = intensify(heat_lut[n - 1], 0.05);
+		if (heat_lut[n] == heat_lut[n - 1])
+			break;
+	}
+	heat_lut_max = n - 1;
+}
+
 static int speed_kph_to_clridx(double kph)
 {
 	int speed;
@@ -478,14 +963,13 @@ static int speed_kph_to_clridx(double kph)
 	return countof(spdclr) - 1;
 }
 
-static void diag_draw_tile_speed(struct tile *tile, const struct gpx_point *pt,
+static void diag_draw_tile_speed(struct tile *tile, double kph,
 				 const struct xy pix)
 {
 	char speed[8];
 	int xx, yy;
 
-	tile->has_speed = 1;
-	snprintf(speed, sizeof(speed), "%.1f", pt->speed * 3.6);
+	snprintf(speed, sizeof(speed), "%.1f", kph);
 	gdImageString (tile->img, gdFontSmall, 0, 0,
 		       (unsigned char *)speed, SPEED_CLR);
 	xx = gdFontSmall->w * strlen(speed);
@@ -494,20 +978,118 @@ static void diag_draw_tile_speed(struct tile *tile, const struct gpx_point *pt,
 	gdImageLine(tile->img, xx, yy, pix.x, pix.y, SPEED_CLR);
 }
 
+/*
+ * The drawing into a tile. With -B, the operations on the tiles of a zoom
+ * level are recorded in them first, then each tile is opened, drawn and
+ * flushed at once by draw_bins(), so that it is loaded and saved only once
+ * even with few tiles in memory.
+ */
+#define TILE_OP_PIXEL (0)
+#define TILE_OP_HEAT (1) /* of the square of radius x2 */
+#define TILE_OP_LINE (2)
+#define TILE_OP_ELLIPSE (3) /* of diameter x2 */
+#define TILE_OP_FILLED_ELLIPSE (4)
+#define TILE_OP_SPEED (5)
+
+struct tile_op
+{
+	int op;
+	union {
+		int color;
+		float speed; /* m/s, TILE_OP_SPEED */
+	};
+	int x1, y1, x2, y2;
+};
+
+static void exec_tile_op(struct tile *tile, const struct tile_op *op)
+{
+	int x, y;
+
+	switch (op->op) {
+	case TILE_OP_PIXEL:
+		gdImageSetPixel(tile->img, op->x1, op->y1, op->color);
+		gdImageSetAntiAliased(tile->img, op->color);
+		break;
+	case TILE_OP_HEAT:
+		for (y = op->y1 - op->x2; y <= op->y1 + op->x2; ++y)
+			for (x = op->x1 - op->x2; x <= op->x1 + op->x2; ++x)
+				heat_add(tile, x, y);
+		gdImageSetAntiAliased(tile->img, op->color);
+		break;
+	case TILE_OP_LINE:
+		gdImageLine(tile->img, op->x1, op->y1, op->x2, op->y2, op->color);
+		break;
+	case TILE_OP_ELLIPSE:
+		gdImageEllipse(tile->img, op->x1, op->y1, op->x2, op->x2,
+			       op->color);
+		break;
+	case TILE_OP_FILLED_ELLIPSE:
+		gdImageFilledEllipse(tile->img, op->x1, op->y1, op->x2, op->x2,
+				     op->color);
+		break;
+	case TILE_OP_SPEED:
+		diag_draw_tile_speed(tile, op->speed * 3.6, XY(op->x1, op->y1));
+		break;
+	}
+}
+
+static void tile_draw(struct tile *tile, const struct tile_op *op)
+{
+	if (!binning) {
+		exec_tile_op(tile, op);
+		return;
+	}
+	if (tile->ops_cnt == tile->ops_size) {
+		const int size = tile->ops_size ? 2 * tile->ops_size : 16;
+
+		memory_account((long)(size - tile->ops_size) * sizeof(*tile->ops));
+		tile->ops_size = size;
+		tile->ops = realloc(tile->ops, tile->ops_size * sizeof(*tile->ops));
+	}
+	tile->ops[tile->ops_cnt++] = *op;
+}
+
+/* the recorded drawing of the zoom levels, one tile at a time */
+static void draw_bins(const int *zooms, int zooms_cnt)
+{
+	struct tile *tile;
+	unsigned i;
+	int j, k;
+
+	binning = 0;
+	for (j = 0; j < zooms_cnt; ++j) {
+		const int z = zooms[j];
+
+		zoom_level_for_each(tile, zoom_levels + z, i) {
+			open_tile(tile, z);
+			for (k = 0; k < tile->ops_cnt; ++k)
+				exec_tile_op(tile, tile->ops + k);
+			memory_account(-(long)tile->ops_size * sizeof(*tile->ops));
+			free(tile->ops);
+			tile->ops = NULL;
+			tile->ops_cnt = tile->ops_size = 0;
+			/* flushed as soon as there are too many */
+			close_tile(tile, z);
+		}
+	}
+}
+
 static void diag_draw_point(int z, struct tile *tile,
-			    const struct gpx_point *pt,
+			    const struct gpx_segment *seg, int i,
 			    const struct xy pix,
 			    int color)
 {
-	if (z >= 17 && (pt->flags & GPX_PT_PDOP) && pt->pdop > 1.8) {
-		int d = (int)floor(pt->pdop * 3);
+	if (z >= 17 && (seg->flags[i] & GPX_PT_PDOP) && seg->pdop[i] > 1.8) {
+		int d = (int)floor(seg->pdop[i] * 3);
 
-		gdImageEllipse(tile->img, pix.x, pix.y,
-			       d, d, (20 << 24) | color);
+		tile_draw(tile, &(struct tile_op){
+			.op = TILE_OP_ELLIPSE, .color = (20 << 24) | color,
+			.x1 = pix.x, .y1 = pix.y, .x2 = d });
 	}
 	else if (drop_shadows)
-		gdImageEllipse(tile->img, pix.x, pix.y,
-			       5, 5, (20 << 24) | SHADOW);
+		tile_draw(tile, &(struct tile_op){
+			.op = TILE_OP_ELLIPSE, .color = (20 << 24) | SHADOW,
+			.x1 = pix.x, .y1 = pix.y, .x2 = 5 });
 }
 
 struct neigh_tile {
@@ -528,14 +1110,14 @@ static void xy_out_of_range(struct xy *xy, int z)
 		xy->y = max;
 }
 
-static struct neigh_tile neigh_tile_circle(int z, const struct tile *tile,
+static struct neigh_tile neigh_tile_circle(int z, const struct xy *xy,
 					   const struct xy pix,
 					   int radius)
 {
 	struct neigh_tile n;
 	int d;
 
-	n.lt = n.rb = tile->xy;
+	n.lt = n.rb = *xy;
 	d = pix.x - radius;
 	if (d < 0)
 		n.lt.x += d / TILE_W - 1;
@@ -576,22 +1158,21 @@ static int next_neigh_tile(struct neigh_tile *n)
 	return 1;
 }
 
-static void draw_point_circle(int z, struct tile *tile,
-			      const struct gpx_point *pt,
+static void draw_point_circle(int z, const struct xy *xy,
 			      const struct xy pix,
 			      int color)
 {
-	struct neigh_tile n = neigh_tile_circle(z, tile, pix, point_circle_diameter);
+	struct neigh_tile n = neigh_tile_circle(z, xy, pix, point_circle_diameter);
 
 	do {
-		tile = get_tile_at(&n.xy, z);
+		struct tile *tile = get_tile_at(&n.xy, z);
+
 		if (!tile)
 			continue;
 		open_tile(tile, z);
-		gdImageFilledEllipse(tile->img, n.pix.x, n.pix.y,
-				     point_circle_diameter,
-				     point_circle_diameter,
-				     point_circle_color);
+		tile_draw(tile, &(struct tile_op){
+			.op = TILE_OP_FILLED_ELLIPSE, .color = point_circle_color,
+			.x1 = n.pix.x, .y1 = n.pix.y, .x2 = point_circle_diameter });
 		close_tile(tile, z);
 	} while (next_neigh_tile(&n));
 }
@@ -599,172 +1180,461 @@ static void draw_point_circle(int z, struct tile *tile,
 #define DRAW_TRKPTR_NO_LINES (1u)
 #define DRAW_TRKPTR_BADSRC (2u)
 #define DRAW_TRKPTR_CIRCLE (4u)
-static void draw_track_points(struct gpx_point *points, int z, unsigned flags)
+#define DRAW_TRKPTR_LEAD_IN (8u) /* the first point is where the line comes from */
+
+static int point_color(const struct gpx_segment *seg, int i, unsigned flags)
 {
-	struct gpx_point *pt, *ppt;
-	struct xy ppix = { 0 }, pxy;
+	int speed = 0;
+
+	if (z_no_lines == HEATMAP_MODE)
+		return heatmapclr;
+	if (!(flags & DRAW_TRKPTR_BADSRC) && (seg->flags[i] & GPX_PT_SPEED))
+		speed = speed_kph_to_clridx(seg->speed[i] * 3.6);
+	switch (set_speed) {
+	case INT_MIN:
+		return spdclr[speed].clr;
+	case INT_MAX:
+		return fixclr;
+	default:
+		speed = speed_kph_to_clridx((double)set_speed);
+		return spdclr[speed].clr;
+	}
+}
 
-	for (pt = ppt = points; pt; pt = pt->next) {
-		int color;
-		struct tile *ptile;
-		struct xy pix = {0}; // ???
-		struct xy xy = get_tile_xy(&pt->loc, z);
+/* where draw_track_points() stopped in the segment, zeroed at its start */
+struct track_pos
+{
+	int k;
+	struct xy ppix, pxy;
+};
+
+/* the points of the segment to draw at the zoom, idx is NULL for all of them */
+static int band_points(const struct gpx_segment *seg, int z, const int **idx)
+{
+	int k, n = seg->points_cnt;
+
+	*idx = NULL;
+	for (k = 0; k < seg->bands_cnt && seg->bands[k].z >= z; ++k) {
+		*idx = seg->bands[k].idx;
+		n = seg->bands[k].points_cnt;
+	}
+	return n;
+}
+
+/* draws the points of the segment before the point end */
+static void draw_track_points(const struct gpx_segment *seg, int z, unsigned flags,
+			      struct track_pos *pos, int end)
+{
+	struct xy ppix = pos->ppix, pxy = pos->pxy;
+	const int *idx;
+	int k, n = band_points(seg, z, &idx), box_end = 0;
+
+	for (k = pos->k; k < n; ++k) {
+		const int i = idx ? idx[k] : k;
+		if (i >= end)
+			break;
+		/* the points of a box drawn only by other threads, to the last one */
+		if (i >= box_end && seg->boxes && shards > 1) {
+			box_end = min((i / GPX_BOX_POINTS + 1) * GPX_BOX_POINTS, end);
+			if (!shard_box(seg->boxes + i / GPX_BOX_POINTS,
+				       k ? &pxy : NULL, z)) {
+				while (k + 1 < n && (idx ? idx[k + 1] : k + 1) < box_end)
+					++k;
+				ppix = getPixelPosForCoordinates(&seg->merc[idx ? idx[k] : k], z);
+				pxy = get_tile_xy(&seg->merc[idx ? idx[k] : k], z);
+				continue;
+			}
+		}
+		const unsigned ptflags = seg->flags[i];
+		const int color = point_color(seg, i, flags);
+		struct xy pix = getPixelPosForCoordinates(&seg->merc[i], z);
+		struct xy xy = get_tile_xy(&seg->merc[i], z);
+		/* NULL if it is drawn by another thread, see tile_shard() */
 		struct tile *tile = get_tile_at(&xy, z);
 
-		if (!tile)
-			goto setppt;
-		open_tile(tile, z);
-		tile->point_cnt++;
-		pix = getPixelPosForCoordinates(&pt->loc, z);
-		if (ppt == pt) {
-			ptile = open_tile(tile, z);
+		if (k == 0) {
 			ppix = pix;
 			pxy = xy;
-		} else {
-			ptile = get_tile_at(&pxy, z);
-			open_tile(ptile, z);
 		}
-		if (z_no_lines == HEATMAP_MODE) {
-			color = gdImageGetTrueColorPixel(tile->img, pix.x, pix.y);
-			color = color ? intensify(color, 0.05) : heatmapclr;
-			if (z < z_heatmap_bigdots)
-				gdImageSetPixel(tile->img, pix.x, pix.y, color);
+		if (tile) {
+			open_tile(tile, z);
+			tile->point_cnt++;
+			if (z_no_lines != HEATMAP_MODE)
+				tile_draw(tile, &(struct tile_op){
+					.op = TILE_OP_PIXEL, .color = color,
+					.x1 = pix.x, .y1 = pix.y });
 			else
-				gdImageFilledRectangle(tile->img,
-						       pix.x - 1, pix.y - 1,
-						       pix.x + 1, pix.y + 1,
-						       color);
-		} else {
-			int speed = 0;
-
-			if (!(flags & DRAW_TRKPTR_BADSRC) && (pt->flags & GPX_PT_SPEED))
-				speed = speed_kph_to_clridx(pt->speed * 3.6);
-			switch (set_speed) {
-			case INT_MIN:
-				color = spdclr[speed].clr;
-				break;
-			case INT_MAX:
-				color = fixclr;
-				break;
-			default:
-				speed = speed_kph_to_clridx((double)set_speed);
-				color = spdclr[speed].clr;
-				break;
-			}
-			gdImageSetPixel(tile->img, pix.x, pix.y, color);
+				tile_draw(tile, &(struct tile_op){
+					.op = TILE_OP_HEAT, .color = color,
+					.x1 = pix.x, .y1 = pix.y,
+					.x2 = z >= z_heatmap_bigdots });
 		}
-
-		gdImageSetAntiAliased(tile->img, color);
+		/* the circles can be on the neighbour tiles */
 		if (flags & DRAW_TRKPTR_CIRCLE)
-			draw_point_circle(z, tile, pt, pix, color);
-		diag_draw_point(z, tile, pt, pix, color);
-		if (draw_speed && !tile->has_speed)
-			diag_draw_tile_speed(tile, pt, pix);
+			draw_point_circle(z, &xy, pix, color);
+		if (tile) {
+			diag_draw_point(z, tile, seg, i, pix, color);
+			if (draw_speed && !tile->has_speed) {
+				tile->has_speed = 1;
+				tile_draw(tile, &(struct tile_op){
+					.op = TILE_OP_SPEED,
+					.speed = seg->speed ? seg->speed[i] : 0.0f,
+					.x1 = pix.x, .y1 = pix.y });
+			}
+		}
 		if (flags & DRAW_TRKPTR_NO_LINES)
-			goto close_tiles;
+			goto close_tile;
 		/* Don't draw slow segments */
-		if ((pt->flags & GPX_PT_SPEED) &&
-		    pt->speed * 3.6 < no_lines_speed)
-			goto close_tiles;
-		if (tile == ptile) {
-			if (ppix.x != pix.x || ppix.y != pix.y)
-				gdImageLine(tile->img, pix.x, pix.y,
-					    ppix.x, ppix.y, color);
-			goto close_tiles;
+		if ((ptflags & GPX_PT_SPEED) &&
+		    seg->speed[i] * 3.6 < no_lines_speed)
+			goto close_tile;
+		if (xy.x == pxy.x && xy.y == pxy.y) {
+			if (tile && (ppix.x != pix.x || ppix.y != pix.y))
+				tile_draw(tile, &(struct tile_op){
+					.op = TILE_OP_LINE, .color = color,
+					.x1 = pix.x, .y1 = pix.y,
+					.x2 = ppix.x, .y2 = ppix.y });
+			goto close_tile;
 		}
-		const int dx = tile->xy.x - ptile->xy.x;
-		const int dy = tile->xy.y - ptile->xy.y;
+		const int dx = xy.x - pxy.x;
+		const int dy = xy.y - pxy.y;
 		int x, y;
-		for (x = ptile->xy.x; ; x += dx > 0 ? 1: -1) {
-			for (y = ptile->xy.y; ; y += dy > 0 ? 1 : -1) {
-				int x1 = ppix.x - TILE_W * (x - ptile->xy.x);
-				int y1 = ppix.y - TILE_H * (y - ptile->xy.y);
-				int x2 = pix.x - TILE_W * (x - tile->xy.x);
-				int y2 = pix.y - TILE_H * (y - tile->xy.y);
-
-				if (crossing_tile(x1, y1, x2, y2)) {
-					struct xy ixy = { .x = x, .y = y };
-					struct tile *itile = get_tile_at(&ixy, z);
+		for (x = pxy.x; ; x += dx > 0 ? 1: -1) {
+			for (y = pxy.y; ; y += dy > 0 ? 1 : -1) {
+				int x1 = ppix.x - TILE_W * (x - pxy.x);
+				int y1 = ppix.y - TILE_H * (y - pxy.y);
+				int x2 = pix.x - TILE_W * (x - xy.x);
+				int y2 = pix.y - TILE_H * (y - xy.y);
+				struct xy ixy = { .x = x, .y = y };
+				struct tile *itile;
+
+				if (crossing_tile(x1, y1, x2, y2) &&
+				    (itile = get_tile_at(&ixy, z))) {
 					open_tile(itile, z);
 					/*
 					printf("z %d %f,%f %d,%d line (%d,%d, %d,%d)\n", z,
-					       pt->loc.lat, pt->loc.lon,
+					       seg->loc[i].lat, seg->loc[i].lon,
 					       x, y, x1, y1, x2, y2);
 					*/
-					gdImageLine(itile->img, x1, y1, x2, y2,
-						    highlight_tile_cross ? HIGHLIGHT : color);
+					tile_draw(itile, &(struct tile_op){
+						.op = TILE_OP_LINE,
+						.color = highlight_tile_cross ? HIGHLIGHT : color,
+						.x1 = x1, .y1 = y1, .x2 = x2, .y2 = y2 });
 					close_tile(itile, z);
 				}
-				if (y == tile->xy.y)
+				if (y == xy.y)
 					break;
 			}
-			if (x == tile->xy.x)
+			if (x == xy.x)
+				break;
+		}
+	close_tile:
+		if (tile)
+			close_tile(tile, z);
+		ppix = pix;
+		pxy = xy;
+	}
+	pos->k = k;
+	pos->ppix = ppix;
+	pos->pxy = pxy;
+}
+
+/*
+ * The segments are drawn into all the zoom levels a block of points at a
+ * time, so that the points are read from memory only once.
+ */
+#define TRACK_BLOCK (1024)
+
+static void make_file_tiles(struct gpx_file *f, const int *zooms, int zooms_cnt)
+{
+	struct track_pos pos[ZOOM_MAX + 1];
+	struct gpx_segment *seg;
+	int j;
+
+	slist_for_each(seg, &f->gpx->segments) {
+		int end = 0;
+
+		memset(pos, 0, zooms_cnt * sizeof(*pos));
+		while (end < seg->points_cnt) {
+			end = min(end + TRACK_BLOCK, seg->points_cnt);
+			for (j = 0; j < zooms_cnt; ++j) {
+				const int z = zooms[j];
+
+				/*
+				 * Th GPS data source GPX_SRC_NETWORK is not reliable
+				 * and precise enough to use it for speed analysis.
+				 *
+				 * Don't draw lines at high zoom levels, because they
+				 * all are on the same pixel.
+				 */
+				draw_track_points(seg, z,
+						  (z < z_no_lines ? DRAW_TRKPTR_NO_LINES : 0) |
+						  (seg->src == GPX_SRC_NETWORK ? DRAW_TRKPTR_BADSRC : 0),
+						  pos + j, end);
+			}
+		}
+	}
+	for (j = 0; j < zooms_cnt; ++j) {
+		const int z = zooms[j];
+
+		if (z > z_no_wpts && f->gpx->wpts) {
+			struct track_pos wpos = { 0 };
+
+			draw_track_points(f->gpx->wpts, z,
+					  DRAW_TRKPTR_NO_LINES | DRAW_TRKPTR_CIRCLE,
+					  &wpos, f->gpx->wpts->points_cnt);
+		}
+		if (verbose > 0)
+			printf("z %2d %s (%d points, tiles %d)\n", z, f->gpx->path,
+			       f->gpx->points_cnt,
+			       zoom_levels[z].tile_cnt);
+	}
+}
+
+static void make_tiles(struct gpx_file *files, const int *zooms, int zooms_cnt)
+{
+	struct gpx_file *f;
+
+	for (f = files; f; f = f->next)
+		make_file_tiles(f, zooms, zooms_cnt);
+}
+
+/*
+ * -O: the points to draw at a zoom level are in its spill, in pieces of the
+ * runs of points falling into a bucket of tiles, so that the tiles are drawn
+ * roughly one bucket after another. The pieces of a bucket keep the order of
+ * the files and of their points.
+ */
+#define SPILL_BUCKET_BITS (3) /* 8x8 tiles */
+
+static struct gpx_spill *spills[ZOOM_MAX + 1];
+
+static uint64_t spill_key(const struct merc *m, int z)
+{
+	return morton_spread(merc2tile(m->x, z) >> SPILL_BUCKET_BITS) |
+		morton_spread(merc2tile(m->y, z) >> SPILL_BUCKET_BITS) << 1;
+}
+
+/* a piece with a line starts with the point before it */
+static void spill_segment(const struct gpx_file *gf, const struct gpx_segment *seg,
+			  int z, unsigned flags, uint32_t *seq)
+{
+	const int *idx;
+	int start, k, n = band_points(seg, z, &idx);
+
+	for (start = 0; start < n; start = k) {
+		const uint64_t key = spill_key(&seg->merc[idx ? idx[start] : start], z);
+		const int lead = start > 0 && !(flags & DRAW_TRKPTR_NO_LINES);
+
+		for (k = start + 1; k < n; ++k)
+			if (spill_key(&seg->merc[idx ? idx[k] : k], z) != key)
 				break;
+		gpx_spill_write(spills[z], key, (uint64_t)gf->no << 32 | (*seq)++,
+				flags | (lead ? DRAW_TRKPTR_LEAD_IN : 0),
+				seg, idx, start - lead, k - start + lead);
+	}
+}
+
+/* as drawn by make_file_tiles() */
+static void spill_file(const struct gpx_file *gf)
+{
+	const struct gpx_segment *seg;
+	int z;
+
+	for (z = zoom_draw; z <= zoom_max; ++z) {
+		uint32_t seq = 0;
+
+		slist_for_each(seg, &gf->gpx->segments)
+			spill_segment(gf, seg, z,
+				      (z < z_no_lines ? DRAW_TRKPTR_NO_LINES : 0) |
+				      (seg->src == GPX_SRC_NETWORK ? DRAW_TRKPTR_BADSRC : 0),
+				      &seq);
+		if (z > z_no_wpts && gf->gpx->wpts)
+			spill_segment(gf, gf->gpx->wpts, z,
+				      DRAW_TRKPTR_NO_LINES | DRAW_TRKPTR_CIRCLE, &seq);
+	}
+}
+
+static void spill_draw(const struct gpx_segment *seg, unsigned flags, void *arg)
+{
+	const int z = *(const int *)arg;
+	struct track_pos pos = { 0 };
+
+	if (flags & DRAW_TRKPTR_LEAD_IN) {
+		pos.k = 1;
+		pos.ppix = getPixelPosForCoordinates(seg->merc, z);
+		pos.pxy = get_tile_xy(seg->merc, z);
+	}
+	draw_track_points(seg, z, flags & ~DRAW_TRKPTR_LEAD_IN, &pos,
+			  seg->points_cnt);
+}
+
+static void draw_zooms(const int *zooms, int zooms_cnt)
+{
+	int i;
+
+	binning = bin_tiles;
+	if (!spill_dir)
+		make_tiles(gpx_files.head, zooms, zooms_cnt);
+	else
+		for (i = 0; i < zooms_cnt; ++i) {
+			int z = zooms[i];
+
+			gpx_spill_read(spills[z], spill_draw, &z);
+		}
+	if (bin_tiles)
+		draw_bins(zooms, zooms_cnt);
+}
+
+static inline void save_zoom_level(int z)
+{
+	struct tile *tile;
+	unsigned i;
+	int len = 0;
+
+	zoom_level_for_each(tile, zoom_levels + z, i) {
+		if (tile->img)
+			flush_tile(tile, z, 0);
+		if (verbose > 1) {
+			if (!len)
+				len += printf("z %d", z);
+			len += printf(" %d/%d (%d)",
+				      tile->xy.x, tile->xy.y,
+				      tile->point_cnt);
+			if (len >= 60) {
+				fputc('\n', stdout);
+				len = 0;
+			}
+		}
+	}
+	if (verbose > 1 && len)
+		fputc('\n', stdout);
+}
+
+/*
+ * The dots and the heatmap of a zoom level are nearly the tiles of the
+ * next one shrunk by half, so in the pyramid mode they are made that way.
+ * The hits of the heatmap are summed, and a pixel of the dots takes the
+ * color of the first of its 4 children which is not transparent.
+ */
+static int reduce_pixels(const int c[4])
+{
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		if (!pixel_empty(c[i]))
+			return c[i];
+	return c[0];
+}
+
+static void reduce_hits(struct tile *parent, const struct tile *child,
+			int ox, int oy)
+{
+	int x, y;
+
+	for (y = 0; y < TILE_H / 2; ++y)
+		for (x = 0; x < TILE_W / 2; ++x) {
+			const uint16_t *h = child->hits + 2 * y * TILE_W + 2 * x;
+			unsigned sum = h[0] + h[1] + h[TILE_W] + h[TILE_W + 1];
+
+			parent->hits[(oy + y) * TILE_W + ox + x] = min(sum, UINT16_MAX);
 		}
-	close_tiles:
-		close_tile(ptile, z);
-		close_tile(tile, z);
-	setppt:
-		ppix = pix;
-		pxy = xy;
-		ppt = pt;
-	}
 }
 
-static void make_tiles(struct gpx_file *files, int z)
+/* into the quarter of the parent tile the child covers */
+static void reduce_tile(struct tile *parent, const struct tile *child)
 {
-	struct gpx_file *f;
+	const int ox = (child->xy.x & 1) * TILE_W / 2;
+	const int oy = (child->xy.y & 1) * TILE_H / 2;
+	int x, y;
 
-	for (f = files; f; f = f->next) {
-		struct gpx_segment *seg;
-
-		slist_for_each(seg, &f->gpx->segments) {
-			/*
-			 * Th GPS data source GPX_SRC_NETWORK is not reliable
-			 * and precise enough to use it for speed analysis.
-			 *
-			 * Don't draw lines at high zoom levels, because they
-			 * all are on the same pixel.
-			 */
-			draw_track_points(seg->points.head, z,
-					  (z < z_no_lines ? DRAW_TRKPTR_NO_LINES : 0) |
-					  (seg->src == GPX_SRC_NETWORK ? DRAW_TRKPTR_BADSRC : 0));
+	parent->point_cnt += child->point_cnt;
+	if (parent->hits && child->hits) {
+		reduce_hits(parent, child, ox, oy);
+		return;
+	}
+	for (y = 0; y < TILE_H / 2; ++y)
+		for (x = 0; x < TILE_W / 2; ++x) {
+			const int c[4] = {
+				gdImageTrueColorPixel(child->img, 2 * x, 2 * y),
+				gdImageTrueColorPixel(child->img, 2 * x + 1, 2 * y),
+				gdImageTrueColorPixel(child->img, 2 * x, 2 * y + 1),
+				gdImageTrueColorPixel(child->img, 2 * x + 1, 2 * y + 1),
+			};
+
+			gdImageTrueColorPixel(parent->img, ox + x, oy + y) =
+				reduce_pixels(c);
 		}
-		if (z > z_no_wpts)
-			draw_track_points(f->gpx->wpts.head, z,
-					  DRAW_TRKPTR_NO_LINES | DRAW_TRKPTR_CIRCLE);
-		if (verbose > 0)
-			printf("z %2d %s (%d points, tiles %d)\n", z, f->gpx->path,
-			       f->gpx->points_cnt,
-			       zoom_levels[z].tile_cnt);
+}
+
+/*
+ * Only the quarters of the tiles of z with changed children are redrawn:
+ * the others already are the reductions of the children on the disk.
+ */
+static void reduce_zoom_level(int z)
+{
+	struct tile *tile;
+	unsigned i;
+
+	zoom_level_for_each(tile, zoom_levels + z + 1, i) {
+		const struct xy xy = {
+			.x = tile->xy.x >> 1,
+			.y = tile->xy.y >> 1,
+		};
+		/* the pyramid is made by one thread, whatever the shard */
+		struct tile *parent = find_tile(&xy, z);
+
+		if (!parent)
+			parent = alloc_tile(&xy, z);
+		/* reloaded from the disk if it was flushed */
+		open_tile(tile, z + 1);
+		open_tile(parent, z);
+		reduce_tile(parent, tile);
+		close_tile(parent, z);
+		close_tile(tile, z + 1);
 	}
 }
 
-static inline void save_zoom_level(int z)
+/*
+ * The zoom the pyramid is reduced from: the highest one with only dots. The
+ * big dots of the heatmap would be summed into the zooms below, so there it
+ * is the last zoom without them.
+ */
+static int pyramid_zoom(void)
 {
-	int len = 0, h;
-
-	for (h = 0; h < ZOOM_TILE_HASH_SIZE; ++h) {
-		struct tile *tile;
-
-		slist_for_each(tile, &zoom_levels[z].tiles[h]) {
-			if (tile->img)
-				flush_tile(tile, z, 0);
-			if (verbose > 1) {
-				if (!len)
-					len += printf("z %d", z);
-				len += printf(" %d/%d (%d)",
-					      tile->xy.x, tile->xy.y,
-					      tile->point_cnt);
-				if (len >= 60) {
-					fputc('\n', stdout);
-					len = 0;
-				}
-			}
-		}
+	if (!pyramid)
+		return zoom_min;
+	if (z_no_lines == HEATMAP_MODE)
+		return max(zoom_min, min(zoom_max, z_heatmap_bigdots - 1));
+	if (zoom_max < z_no_lines)
+		return zoom_max;
+	return max(zoom_min, z_no_lines - 1);
+}
+
+/*
+ * Makes the zoom levels below z from it, while its tiles are in memory.
+ * Each of them is saved once the next one is made. z is left to the caller.
+ */
+static void make_pyramid(int z)
+{
+	int tile_cnt;
+
+	for (--z; z >= zoom_min; --z) {
+		reduce_zoom_level(z);
+		if (z + 1 == zoom_draw)
+			continue;
+		tile_cnt = zoom_levels[z + 1].tile_cnt;
+		save_zoom_level(z + 1);
+		free_zoom_level(z + 1);
+		printf("z %2d (%d tiles, reduced)\n", z + 1, tile_cnt);
 	}
-	if (verbose > 1 && len)
-		fputc('\n', stdout);
+	if (zoom_min < zoom_draw) {
+		tile_cnt = zoom_levels[zoom_min].tile_cnt;
+		save_zoom_level(zoom_min);
+		free_zoom_level(zoom_min);
+		printf("z %2d (%d tiles, reduced)\n", zoom_min, tile_cnt);
+	}
+	fflush(stdout);
 }
 
 static void remove_tiles(int z)
@@ -772,11 +1642,17 @@ static void remove_tiles(int z)
 	DIR *zdir;
 	struct dirent *ze;
 	char d[16];
+	int fd;
 
 	snprintf(d, sizeof(d), "%d", z);
-	zdir = opendir(d);
-	if (!zdir)
+	fd = openat(tiles_dir, d, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	zdir = fdopendir(fd);
+	if (!zdir) {
+		close(fd);
 		return;
+	}
 	while ((ze = readdir(zdir))) {
 		if (ze->d_name[0] == '.')
 			continue;
@@ -800,6 +1676,76 @@ static void remove_tiles(int z)
 	closedir(zdir);
 }
 
+/*
+ * The existing tiles are drawn on, so they must have been drawn the same
+ * way: each zoom directory has the format of its tiles in TILES_FORMAT_FILE.
+ * Format 2 places the pixels by the Mercator projection, the tiles without
+ * the file interpolated them linearly in latitude.
+ */
+#define TILES_FORMAT (2)
+#define TILES_FORMAT_FILE ".format"
+
+/* the existing tiles of the zoom are in another format, see -I */
+static int zoom_old_format[ZOOM_MAX + 1];
+
+static int read_tiles_format(int z)
+{
+	char path[32], buf[16];
+	ssize_t l;
+	int fd;
+
+	snprintf(path, sizeof(path), "%d/" TILES_FORMAT_FILE, z);
+	fd = openat(tiles_dir, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	l = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	buf[l > 0 ? l : 0] = '\0';
+	return atoi(buf);
+}
+
+/* warns about the zooms whose tiles would be drawn on in another format */
+static void check_tiles_format(void)
+{
+	struct stat st;
+	char d[16];
+	int z, len = 0;
+
+	if (reinitialize)
+		return;
+	for (z = zoom_min; z <= zoom_max; ++z) {
+		snprintf(d, sizeof(d), "%d", z);
+		if (fstatat(tiles_dir, d, &st, 0) < 0 || !S_ISDIR(st.st_mode) ||
+		    read_tiles_format(z) == TILES_FORMAT)
+			continue;
+		zoom_old_format[z] = 1;
+		len += fprintf(stderr, "%s %d", len ? "," : "The tiles of zoom", z);
+	}
+	if (len)
+		fprintf(stderr, " were drawn by an older version, the new tracks "
+			"will not match them: redraw them with -I\n");
+}
+
+/* in the zoom directories with tiles written, unless they were older */
+static void write_tiles_format(void)
+{
+	char path[32];
+	int z, fd;
+
+	for (z = zoom_min; z <= zoom_max; ++z) {
+		if (!zoom_saved[z] || zoom_old_format[z] ||
+		    read_tiles_format(z) == TILES_FORMAT)
+			continue;
+		snprintf(path, sizeof(path), "%d/" TILES_FORMAT_FILE, z);
+		fd = openat(tiles_dir, path,
+			    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (fd < 0 || dprintf(fd, "%d\n", TILES_FORMAT) < 0)
+			perror(path);
+		if (fd >= 0)
+			close(fd);
+	}
+}
+
 #include "dump.h"
 
 struct load
@@ -814,6 +1760,114 @@ static pthread_mutex_t load_q_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t load_q_cond = PTHREAD_COND_INITIALIZER;
 static SLIST_DEFINE(struct load, load_q);
 static SLIST_STACK_DEFINE(struct load, load_free);
+/* -s, under load_q_lock */
+#define STREAM_FILES (2) /* in memory, per thread */
+static pthread_cond_t stream_cond = PTHREAD_COND_INITIALIZER;
+static int stream_files; /* being loaded or not freed yet */
+static int stream_max, stream_readers, stream_points;
+static int stream_end; /* all the files are loaded */
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a, ub = *(const uint64_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/*
+ * Of the tiles of all the files, for shard_ranges(): all of them up to
+ * SHARD_SAMPLE_ZOOM, then half as many at each zoom level, picked by the
+ * hash of their key so that they are the same in all the files.
+ */
+#define SHARD_SAMPLE_ZOOM (14)
+static pthread_mutex_t tile_samples_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	uint64_t *keys;
+	size_t cnt, size;
+} tile_samples[ZOOM_MAX + 1];
+
+/* keys is sorted */
+static void add_tile_samples(int z, const uint64_t *keys, int n)
+{
+	const int shift = max(z - SHARD_SAMPLE_ZOOM, 0);
+	int i;
+
+	pthread_mutex_lock(&tile_samples_lock);
+	for (i = 0; i < n; ++i) {
+		if (i && keys[i] == keys[i - 1])
+			continue;
+		if (shift && keys[i] * 0x9e3779b97f4a7c15ull >> (64 - shift))
+			continue;
+		if (tile_samples[z].cnt == tile_samples[z].size) {
+			tile_samples[z].size = max(2 * tile_samples[z].size, 256ul);
+			tile_samples[z].keys = realloc(tile_samples[z].keys,
+						       tile_samples[z].size *
+						       sizeof(*tile_samples[z].keys));
+		}
+		tile_samples[z].keys[tile_samples[z].cnt++] = keys[i];
+	}
+	pthread_mutex_unlock(&tile_samples_lock);
+}
+
+/*
+ * How many points are drawn at each zoom level, on how many tiles, and the
+ * length of the lines. A point is in the tile of the previous one up to the
+ * zoom level at which their first differing bit becomes a tile bit, so only
+ * the points changing the tile are counted.
+ */
+static void count_points(struct gpx_file *gf)
+{
+	const struct gpx_segment *seg;
+	uint64_t *keys;
+	const int *idx;
+	int i, z, n = 0;
+
+	slist_for_each(seg, &gf->gpx->segments) {
+		for (i = 1; i < seg->points_cnt; ++i) {
+			const struct merc *m = seg->merc + i;
+			uint32_t dx = max(m->x, m[-1].x) - min(m->x, m[-1].x);
+			uint32_t dy = max(m->y, m[-1].y) - min(m->y, m[-1].y);
+
+			gf->line_len += max(dx, dy);
+		}
+		n += seg->points_cnt;
+	}
+	keys = malloc(max(n, 1) * sizeof(*keys));
+	for (z = zoom_draw; z <= zoom_max; ++z) {
+		n = 0;
+		slist_for_each(seg, &gf->gpx->segments) {
+			gf->points[z] += band_points(seg, z, &idx);
+			for (i = 0; i < seg->points_cnt; ++i) {
+				const struct merc *m = seg->merc + i;
+				uint32_t d = i ? (m->x ^ m[-1].x) | (m->y ^ m[-1].y) : 0;
+
+				if (i && (!d || __builtin_clz(d) >= z))
+					continue;
+				keys[n++] = tile_key(merc2tile(m->x, z),
+						     merc2tile(m->y, z));
+			}
+		}
+		qsort(keys, n, sizeof(*keys), cmp_u64);
+		for (i = 0; i < n; ++i)
+			if (!i || keys[i] != keys[i - 1])
+				gf->tiles[z]++;
+		add_tile_samples(z, keys, n);
+	}
+	free(keys);
+}
+
+/* what the parsed points of a file take */
+static long gpx_bytes(const struct gpx_data *gpx)
+{
+	return sizeof(*gpx) + gpx->arena.mapped + gpx->map_size;
+}
+
+static void free_file_points(struct gpx_file *gf)
+{
+	memory_account(-gpx_bytes(gf->gpx));
+	gpx_free(gf->gpx);
+	gf->gpx = NULL;
+}
 
 static void *loader(void *arg)
 {
@@ -830,60 +1884,398 @@ static void *loader(void *arg)
 		if (load_q.head) {
 			if (!load_q.head->gf) {
 				pthread_mutex_unlock(&load_q_lock);
+				gpx_thread_cleanup();
 				pthread_exit(NULL);
 			}
+			/* the jobs keep a file until they get the next one */
+			if (stream && (stream_files >= stream_max ||
+				       (stream_files > 1 && memory_over()))) {
+				pthread_cond_wait(&stream_cond, &load_q_lock);
+				pthread_mutex_unlock(&load_q_lock);
+				continue;
+			}
 			lq = slist_pop(&load_q);
+			if (stream)
+				stream_files++;
 		}
 		pthread_mutex_unlock(&load_q_lock);
 		if (!lq)
 			continue;
 		if (verbose > 0)
 			fprintf(stderr, "%ld: %s open\n", (long)pthread_self(), lq->path);
-		lq->gf->gpx = gpx_read_file(lq->path);
+		if (gpx_cache_dir)
+			lq->gf->gpx = gpx_cache_read_file(lq->path);
+		else
+			lq->gf->gpx = gpx_read_file(lq->path);
+		if (simplify_cnt)
+			gpx_simplify(lq->gf->gpx, simplify_bands, simplify_cnt);
+		gpx_box(lq->gf->gpx);
+		memory_account(gpx_bytes(lq->gf->gpx));
+		lq->gf->points_cnt = lq->gf->gpx->points_cnt;
+		if (estimate_costs)
+			count_points(lq->gf);
+		if (spill_dir) {
+			spill_file(lq->gf);
+			free_file_points(lq->gf);
+		}
 		if (verbose > 0)
 			fprintf(stderr, "%ld: %s loaded\n", (long)pthread_self(), lq->path);
+		if (stream) {
+			pthread_mutex_lock(&load_q_lock);
+			lq->gf->loaded = 1;
+			lq->gf->readers = stream_readers;
+			pthread_cond_broadcast(&stream_cond);
+			pthread_mutex_unlock(&load_q_lock);
+		}
+	}
+}
+
+/* the last job drawing the file frees it, the first one of the list */
+static void stream_release(struct gpx_file *f)
+{
+	if (--f->readers)
+		return;
+	stream_points += f->gpx->points_cnt;
+	free_file_points(f);
+	free(slist_pop(&gpx_files));
+	memory_account(-(long)sizeof(*f));
+	stream_files--;
+	pthread_cond_broadcast(&stream_cond);
+}
+
+/*
+ * -s: all the jobs draw the files at once, in their order, as soon as they
+ * are loaded. The loaders wait for the files to be freed, so that only
+ * stream_max of them are in memory.
+ */
+static void stream_tiles(const int *zooms, int zooms_cnt)
+{
+	struct gpx_file *f = NULL, *next;
+
+	binning = bin_tiles;
+	pthread_mutex_lock(&load_q_lock);
+	while (1) {
+		next = f ? f->next : gpx_files.head;
+		if (!next || !next->loaded) {
+			if (!next && stream_end)
+				break;
+			pthread_cond_wait(&stream_cond, &load_q_lock);
+			continue;
+		}
+		if (f)
+			stream_release(f);
+		f = next;
+		pthread_mutex_unlock(&load_q_lock);
+		make_file_tiles(f, zooms, zooms_cnt);
+		pthread_mutex_lock(&load_q_lock);
 	}
+	if (f)
+		stream_release(f);
+	pthread_mutex_unlock(&load_q_lock);
+	if (bin_tiles)
+		draw_bins(zooms, zooms_cnt);
 }
 
-struct tile_proc
+/*
+ * The threads take their jobs from a shared list, the most expensive first,
+ * so that the last ones to finish are short. A job draws zoom levels for one
+ * shard of their tiles, walking the points near them, see shard_box().
+ */
+struct tile_job
+{
+	const int *zooms;
+	int zooms_cnt;
+	int shard, shards;
+	unsigned long cost;
+};
+
+struct tile_worker
 {
 	pthread_t thr;
-	struct gpx_file *files;
-	int start, end;
-	const int *order;
+	int jobs;
+	struct timespec busy;
 };
 
+static struct tile_job *tile_jobs;
+static int tile_jobs_cnt, tile_jobs_next;
+static int tile_zooms[ZOOM_MAX + 1]; /* from zoom_max down to zoom_draw */
+/* of each zoom level, printed when its last shard is saved */
+static int zoom_shards_left[ZOOM_MAX + 1], zoom_tiles[ZOOM_MAX + 1];
+/* of all the files, see count_points() */
+static unsigned long est_points[ZOOM_MAX + 1], est_tiles[ZOOM_MAX + 1];
+static double est_line_len;
+
+/*
+ * Rough relative weights, in the time of walking a point of another shard:
+ * drawing a point, a pixel of a line, and a tile (opening and saving it,
+ * mostly the PNG compression).
+ */
+#define COST_DRAW (2)
+#define COST_LINE_PIXEL (16)
+#define COST_TILE (300000)
+
+static unsigned long zoom_cost(int z, int shards)
+{
+	double cost = est_points[z] * COST_DRAW + est_tiles[z] * COST_TILE;
+
+	if (z >= z_no_lines)
+		cost += ldexp(est_line_len, z - 24) * COST_LINE_PIXEL;
+	return est_points[z] + cost / shards;
+}
+
 static void *tile_processor(void *arg)
 {
-	const struct tile_proc *tp = arg;
+	struct tile_worker *w = arg;
+	int j;
+
+	prepare_zoom_levels();
+	while ((j = __atomic_fetch_add(&tile_jobs_next, 1, __ATOMIC_RELAXED)) <
+	       tile_jobs_cnt) {
+		const struct tile_job *job = tile_jobs + j;
+		struct timespec start, end;
+		int i;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		shard = job->shard;
+		shards = job->shards;
+		if (stream)
+			stream_tiles(job->zooms, job->zooms_cnt);
+		else
+			draw_zooms(job->zooms, job->zooms_cnt);
+		for (i = 0; i < job->zooms_cnt; ++i) {
+			int tiles, z = job->zooms[i];
+
+			if (z == zoom_draw && z > zoom_min)
+				make_pyramid(z);
+			__atomic_add_fetch(&zoom_tiles[z], zoom_levels[z].tile_cnt,
+					   __ATOMIC_RELAXED);
+			save_zoom_level(z);
+			free_zoom_level(z);
+			if (__atomic_sub_fetch(&zoom_shards_left[z], 1,
+					       __ATOMIC_ACQ_REL))
+				continue;
+			tiles = __atomic_load_n(&zoom_tiles[z], __ATOMIC_RELAXED);
+			printf("z %2d (%d tiles)\n", z, tiles);
+			fflush(stdout);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		w->busy = timespec_add(w->busy, timespec_sub(end, start));
+		w->jobs++;
+	}
+	free(zoom_levels);
+	zoom_levels = NULL;
+	return NULL;
+}
+
+/* of about as many sampled tiles each, by hash if there are too few */
+static void shard_ranges(int z, int shards)
+{
+	uint64_t *keys = tile_samples[z].keys;
+	size_t i, n = 0;
+	int s;
+
+	if (shards < 2)
+		return;
+	qsort(keys, tile_samples[z].cnt, sizeof(*keys), cmp_u64);
+	for (i = 0; i < tile_samples[z].cnt; ++i)
+		if (!n || keys[i] != keys[n - 1])
+			keys[n++] = keys[i];
+	if (n < (size_t)shards)
+		return;
+	shard_bounds[z] = malloc((shards - 1) * sizeof(*shard_bounds[z]));
+	for (s = 1; s < shards; ++s)
+		shard_bounds[z][s - 1] = keys[s * n / shards];
+}
+
+static void add_tile_job(const int *zooms, int zooms_cnt, int shards)
+{
+	int i, s;
+
+	for (s = 0; s < shards; ++s) {
+		struct tile_job *job = tile_jobs + tile_jobs_cnt++;
+
+		job->zooms = zooms;
+		job->zooms_cnt = zooms_cnt;
+		job->shard = s;
+		job->shards = shards;
+		job->cost = 0;
+		for (i = 0; i < zooms_cnt; ++i)
+			job->cost += zoom_cost(zooms[i], shards);
+	}
+	for (i = 0; i < zooms_cnt; ++i) {
+		zoom_shards_left[zooms[i]] = shards;
+		shard_ranges(zooms[i], shards);
+	}
+}
+
+/* by decreasing cost, then as they were added */
+static int tile_job_cmp(const void *a, const void *b)
+{
+	const struct tile_job *ja = a, *jb = b;
+
+	if (ja->cost != jb->cost)
+		return ja->cost < jb->cost ? 1 : -1;
+	if (ja->zooms[0] != jb->zooms[0])
+		return jb->zooms[0] - ja->zooms[0];
+	return ja->shard - jb->shard;
+}
+
+/* no more shards than tiles, see count_points() */
+static int zoom_shards(int z, int parallel)
+{
+	if (est_tiles[z] < (unsigned long)parallel)
+		return max((int)est_tiles[z], 1);
+	return parallel;
+}
+
+static void make_tile_jobs(int parallel)
+{
+	/* the pyramid is reduced from all the tiles of zoom_draw */
+	int pyramid_job = zoom_draw > zoom_min;
+	int z, i, zooms_cnt = 0;
+
+	for (z = zoom_max; z >= zoom_draw; --z)
+		tile_zooms[zooms_cnt++] = z;
+	tile_jobs = calloc(zooms_cnt * parallel + 1, sizeof(*tile_jobs));
+	if (one_pass || stream) {
+		if (zooms_cnt > pyramid_job)
+			add_tile_job(tile_zooms, zooms_cnt - pyramid_job, parallel);
+	} else {
+		for (i = 0; i < zooms_cnt - pyramid_job; ++i)
+			add_tile_job(tile_zooms + i, 1,
+				     zoom_shards(tile_zooms[i], parallel));
+	}
+	if (pyramid_job)
+		add_tile_job(tile_zooms + zooms_cnt - 1, 1, 1);
+	qsort(tile_jobs, tile_jobs_cnt, sizeof(*tile_jobs), tile_job_cmp);
+	for (z = 0; z <= ZOOM_MAX; ++z) {
+		free(tile_samples[z].keys);
+		tile_samples[z].keys = NULL;
+		tile_samples[z].cnt = tile_samples[z].size = 0;
+	}
+}
+
+/* sets threads to the number of the started ones */
+static struct tile_worker *start_tile_workers(int *threads)
+{
+	struct tile_worker *workers = calloc(*threads, sizeof(*workers));
 	int i;
 
-	for (i = tp->start; i < tp->end; ++i) {
-		int tile_cnt, z = tp->order[i];
+	for (i = 0; i < *threads; ++i) {
+		int err = pthread_create(&workers[i].thr, NULL,
+					 tile_processor, workers + i);
 
-		make_tiles(tp->files, z);
-		tile_cnt = zoom_levels[z].tile_cnt;
-		save_zoom_level(z);
-		free_zoom_level(z);
-		printf("z %2d (%d tiles)\n", z, tile_cnt);
-		fflush(stdout);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s (%d)\n",
+				strerror(err), err);
+			break;
+		}
 	}
-	return NULL;
+	*threads = i;
+	return workers;
+}
+
+static void join_tile_workers(struct tile_worker *workers, int threads,
+			      struct timespec start)
+{
+	struct timespec end, duration;
+	int i;
+
+	for (i = 0; i < threads; ++i) {
+		int err = pthread_join(workers[i].thr, NULL);
+
+		if (err) {
+			fprintf(stderr, "pthread_join: %s (%d)\n",
+				strerror(err), err);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	duration = timespec_sub(end, start);
+	for (i = 0; i < threads; ++i) {
+		struct timespec idle = timespec_sub(duration, workers[i].busy);
+
+		fprintf(stderr, "thread %d: %d jobs, busy %ld.%03ld, "
+			"idle %ld.%03ld\n", i, workers[i].jobs,
+			workers[i].busy.tv_sec,
+			workers[i].busy.tv_nsec / 1000000,
+			idle.tv_sec, idle.tv_nsec / 1000000);
+	}
+	free(workers);
+	free(tile_jobs);
+	for (i = 0; i <= ZOOM_MAX; ++i) {
+		free(shard_bounds[i]);
+		shard_bounds[i] = NULL;
+	}
+}
+
+static void prepare_drawing(void)
+{
+	int z;
+
+	if (reinitialize) {
+		fprintf(stderr, "Reinitializing zoom %d - %d\n",
+			zoom_min, zoom_max);
+		for (z = zoom_min; z <= zoom_max; ++z)
+			remove_tiles(z);
+	}
+	prepare_zoom_levels();
+	if (z_no_lines == HEATMAP_MODE)
+		prepare_heat_lut();
+}
+
+/* bytes, with an optional K, M or G suffix */
+static long parse_size(const char *s)
+{
+	char *end;
+	long size = strtol(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		size <<= 10;
+		++end;
+		break;
+	}
+	return *end || size < 0 ? -1 : size;
 }
 
 static void usage(const char *argv0)
 {
 	fprintf(stderr,
 		"%s [-z <min-zoom>] [-Z <max-zoom>] [-C <output-dir>] "
-		"[-j <jobs>] [-T <max-tiles>] [-Ivh] [-L <line-zoom>] "
+		"[-j <jobs>] [-T <max-tiles>] [-Ivh] [-L <line-zoom>] [-X <parser>] "
+		"[-K <cache-dir>] [-O <spill-dir>] [-B] [-m] [-s] [-y] "
+		"[--memory-limit <size>] [--png-level <level>] [--png-strategy <strategy>] "
 		"( [--] [gpx files...] | -0 < file-list )\n"
 		"  -C <output-dir> directory to save the tiles to\n"
 		"  -I delete zoom directories before saving the tiles\n"
-		"  -T <max-tiles> max number of tiles to keep in memory\n"
+		"  -T <max-tiles> max number of tiles of a zoom level to keep in memory, per thread\n"
+		"  -B draw the tiles one at a time, after sorting out what is drawn into each,\n"
+		"     so that they are loaded and saved only once with -T\n"
+		"  --memory-limit <size>[KMG] flush the tiles as soon as they are unused\n"
+		"     when the tiles, the points and the queues of all threads take more\n"
+		"     than <size> bytes; with -s, also wait with loading more files\n"
+		"  --png-level <0-9> zlib compression level of the tiles (default %d)\n"
+		"  --png-strategy <default|filtered|rle|huffman|fixed> zlib strategy of the\n"
+		"     tiles with at most 256 colors, written as indexed PNGs (default rle)\n"
 		"  -j <jobs> number of processing threads\n"
+		"  -m draw all the zoom levels of a shard in one pass over the points,\n"
+		"     with the tiles of all of them in memory at once\n"
+		"  -s like -m, but draw the files while the others are loaded, keeping\n"
+		"     only a few of them in memory\n"
+		"  -O <spill-dir> keep the points to draw in a temporary file in <spill-dir>\n"
+		"     instead of in memory, use with -T to bound the memory of the tiles too\n"
 		"  -L <line-zoom> zoom level above which stop drawing lines (only dots) (default %d)\n"
 		"  -P <line-zoom> zoom level above which stop drawing waypoints (default %d)\n"
 		"  -H heatmap mode\n"
+		"  -y make the zoom levels with only dots (or those without big dots in the\n"
+		"     heatmap mode) by shrinking the tiles of the highest one, instead of\n"
+		"     drawing the points\n"
 		"  -0 read the list of GPX files from stdin, NUL-terminated\n"
 		"     The files given on command-line are processed first\n"
 		"  -z <min-zoom>/-Z <max-zoom> only generate tiles from <min-zoom> to <max-zoom>\n"
@@ -898,25 +2290,45 @@ static void usage(const char *argv0)
 		"  -c <hex-color> draw all lines with the specified color\n"
 		"  -S <kph> assume the speed to be always <kph>\n"
 		"  -p <diameter> diameter (in px) for <wpt> circles\n"
+		"  -X <parser> GPX parser: \"stream\" (default) reads the points as the XML\n"
+		"     is parsed, \"dom\" loads the complete XML document first,\n"
+		"     \"fast\" scans simple machine-written files without libxml2\n"
+		"  -K <cache-dir> keep the parsed points of the GPX files in <cache-dir>\n"
+		"     and read them from there, for as long as the files are unchanged\n"
 		"  -h gives this message\n",
 		argv0,
+		tile_png_level,
 		z_no_lines,
 		z_no_wpts);
 }
 
 int main(int argc, char *argv[])
 {
-	int cd_to = -1;
 	struct timespec start, end, duration;
 	struct gpx_file *gf;
-	SLIST_DEFINE(struct gpx_file, files);
-	int points_cnt, files_cnt = 0;
+	int z, points_cnt, files_cnt = 0;
 	int stdin_files = 0; /* read zero-terminated list of files from stdin */
 	size_t parallel = 4;
 	pthread_t *loaders;
+	struct tile_worker *workers = NULL;
+	enum { OPT_MEMORY_LIMIT = 256, OPT_PNG_LEVEL, OPT_PNG_STRATEGY };
+	static const struct option long_options[] = {
+		{ "memory-limit", required_argument, NULL, OPT_MEMORY_LIMIT },
+		{ "png-level", required_argument, NULL, OPT_PNG_LEVEL },
+		{ "png-strategy", required_argument, NULL, OPT_PNG_STRATEGY },
+		{ NULL, 0, NULL, 0 }
+	};
+	static const struct { const char *name; int strategy; } png_strategies[] = {
+		{ "default", Z_DEFAULT_STRATEGY },
+		{ "filtered", Z_FILTERED },
+		{ "rle", Z_RLE },
+		{ "huffman", Z_HUFFMAN_ONLY },
+		{ "fixed", Z_FIXED },
+	};
 	int opt;
 
-	while ((opt = getopt(argc, argv, "0z:Z:C:j:vT:Id:L:Hht:S:p:P:c:")) != -1)
+	while ((opt = getopt_long(argc, argv, "0z:Z:C:j:vT:Id:L:Hht:S:p:P:c:X:K:mysO:B",
+				  long_options, NULL)) != -1)
 		switch (opt)  {
 			char *p;
 			int z;
@@ -924,8 +2336,8 @@ int main(int argc, char *argv[])
 			stdin_files = 1;
 			break;
 		case 'C':
-			cd_to = open(optarg, O_DIRECTORY | O_PATH | O_CLOEXEC);
-			if (cd_to < 0) {
+			tiles_dir = open(optarg, O_DIRECTORY | O_PATH | O_CLOEXEC);
+			if (tiles_dir < 0) {
 				perror(optarg);
 				exit(2);
 			}
@@ -998,6 +2410,64 @@ int main(int argc, char *argv[])
 		case 'p':
 			point_circle_diameter = strtol(optarg, NULL, 0);
 			break;
+		case 'X':
+			if (strcmp(optarg, "stream") == 0)
+				gpx_parser = GPX_PARSER_STREAM;
+			else if (strcmp(optarg, "dom") == 0)
+				gpx_parser = GPX_PARSER_DOM;
+			else if (strcmp(optarg, "fast") == 0)
+				gpx_parser = GPX_PARSER_FAST;
+			else {
+				fprintf(stderr, "Unknown parser %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'K':
+			if (mkdir(optarg, 0777) < 0 && errno != EEXIST) {
+				perror(optarg);
+				exit(2);
+			}
+			gpx_cache_dir = optarg;
+			break;
+		case 'm':
+			one_pass = 1;
+			break;
+		case 'y':
+			pyramid = 1;
+			break;
+		case 's':
+			stream = 1;
+			break;
+		case 'O':
+			spill_dir = optarg;
+			break;
+		case 'B':
+			bin_tiles = 1;
+			break;
+		case OPT_MEMORY_LIMIT:
+			memory_limit = parse_size(optarg);
+			if (memory_limit <= 0) {
+				fprintf(stderr, "Invalid memory limit: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_PNG_LEVEL:
+			tile_png_level = strtol(optarg, &p, 0);
+			if (*p || tile_png_level < 0 || tile_png_level > 9) {
+				fprintf(stderr, "Invalid PNG level: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_PNG_STRATEGY:
+			for (z = 0; z < (int)countof(png_strategies); ++z)
+				if (strcmp(optarg, png_strategies[z].name) == 0)
+					break;
+			if (z == (int)countof(png_strategies)) {
+				fprintf(stderr, "Invalid PNG strategy: %s\n", optarg);
+				exit(1);
+			}
+			tile_png_strategy = png_strategies[z].strategy;
+			break;
 		case 'v':
 			++verbose;
 			break;
@@ -1013,12 +2483,27 @@ int main(int argc, char *argv[])
 		usage(argv[0]);
 		exit(1);
 	}
+	if (stream && spill_dir) {
+		fprintf(stderr, "-O cannot be used with -s\n");
+		exit(1);
+	}
 	/*
 	 * Extend zoom_max if zoom_min is bigger that it, so that it is
 	 * possible to easily generate zoom level 19 with jist one -z19
 	 */
 	if (zoom_max < zoom_min)
 		zoom_max = zoom_min;
+	check_tiles_format();
+	zoom_draw = pyramid_zoom();
+	/*
+	 * The heatmap counts every point, and the shadows are drawn over each
+	 * other. A band serves the two zooms below its own too.
+	 */
+	if (z_no_lines != HEATMAP_MODE && !drop_shadows)
+		for (opt = 0; opt < (int)countof(simplify_zooms); ++opt)
+			if (simplify_zooms[opt] >= zoom_draw &&
+			    simplify_zooms[opt] - 2 <= zoom_max)
+				simplify_bands[simplify_cnt++] = simplify_zooms[opt];
 	clock_gettime(CLOCK_MONOTONIC, &start);
 	struct load *lq;
 	for (; optind < argc; ++optind) {
@@ -1030,14 +2515,33 @@ int main(int argc, char *argv[])
 		lq->gf = calloc(1, sizeof(*lq->gf));
 		lq->gf->next = NULL;
 		lq->gf->gpx = NULL;
-		++files_cnt;
-		slist_append(&files, lq->gf);
+		lq->gf->no = files_cnt++;
+		memory_account(sizeof(*lq) + lq->path_size + sizeof(*lq->gf));
+		slist_append(&gpx_files, lq->gf);
 		slist_append(&load_q, lq);
 	}
 	if (parallel < 1)
 		parallel = 1;
-	if (parallel >= SIZE_MAX / 2 - 1)
-		parallel = SIZE_MAX / 2 - 1;
+	/* the tile jobs are counted in an int */
+	if (parallel > INT_MAX / (ZOOM_MAX + 1))
+		parallel = INT_MAX / (ZOOM_MAX + 1);
+	gpx_parse_threads = parallel;
+	estimate_costs = parallel > 1 && !stream;
+	if (spill_dir)
+		for (opt = zoom_draw; opt <= zoom_max; ++opt)
+			if (!(spills[opt] = gpx_spill_create(spill_dir)))
+				exit(2);
+	if (stream) {
+		prepare_drawing();
+		start_png_writers(parallel);
+		make_tile_jobs(parallel);
+		/* each job draws all the files, at the same time */
+		stream_readers = tile_jobs_cnt;
+		stream_max = STREAM_FILES * parallel;
+		workers = start_tile_workers(&stream_readers);
+		if (stream_readers < tile_jobs_cnt)
+			exit(1);
+	}
 	loaders = malloc(parallel * sizeof(*loaders));
 	for (opt = 0; opt < parallel; ++opt) {
 		int err = pthread_create(loaders + opt, NULL, loader, NULL);
@@ -1072,6 +2576,7 @@ int main(int argc, char *argv[])
 				if (load_free.head) {
 					lq = slist_stack_pop(&load_free);
 					if (lq->path_size < off) {
+						memory_account(off - lq->path_size);
 						lq->path = realloc(lq->path, off);
 						lq->path_size = off;
 					}
@@ -1079,15 +2584,17 @@ int main(int argc, char *argv[])
 					lq = malloc(sizeof(*lq));
 					lq->path = malloc(off);
 					lq->path_size = off;
+					memory_account(sizeof(*lq) + off);
 				}
 				memcpy(lq->path, buf, off - 1);
 				lq->path[off - 1] = '\0';
 				off = 0;
 				lq->next = NULL;
 				lq->gf = calloc(1, sizeof(*lq->gf));
-				slist_append(&files, lq->gf);
+				lq->gf->no = files_cnt++;
+				memory_account(sizeof(*lq->gf));
+				slist_append(&gpx_files, lq->gf);
 				slist_append(&load_q, lq);
-				++files_cnt;
 				pthread_cond_broadcast(&load_q_cond);
 				pthread_mutex_unlock(&load_q_lock);
 				/*
@@ -1120,48 +2627,74 @@ int main(int argc, char *argv[])
 	clock_gettime(CLOCK_MONOTONIC, &end);
 	while (load_free.head) {
 		lq = slist_stack_pop(&load_free);
+		memory_account(-(long)(sizeof(*lq) + lq->path_size));
 		free(lq->path);
 		free(lq);
 	}
 	free(slist_pop(&load_q));
 	free(loaders);
+	if (stream) {
+		pthread_mutex_lock(&load_q_lock);
+		stream_end = 1;
+		pthread_cond_broadcast(&stream_cond);
+		pthread_mutex_unlock(&load_q_lock);
+		join_tile_workers(workers, stream_readers, start);
+		join_png_writers();
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		duration = timespec_sub(end, start);
+		fprintf(stderr, "%d files, %d points, -j%zu, "
+			"z %d-%d loaded and processed in %ld.%09ld\n",
+			files_cnt, stream_points, parallel, zoom_min, zoom_max,
+			duration.tv_sec, duration.tv_nsec);
+		goto out;
+	}
 	points_cnt = 0;
-	for (gf = files.head; gf; gf = gf->next)
-		points_cnt += gf->gpx->points_cnt;
+	for (gf = gpx_files.head; gf; gf = gf->next)
+		points_cnt += gf->points_cnt;
+	if (spill_dir)
+		for (z = zoom_draw; z <= zoom_max; ++z)
+			if (gpx_spill_sort(spills[z]))
+				exit(1);
 	duration = timespec_sub(end, start);
 	fprintf(stderr, "%d files, %d points, -j%zu, %ld.%09ld sec\n",
 		files_cnt, points_cnt, parallel,
 	       duration.tv_sec, duration.tv_nsec);
-	if (verbose > 3)
-		dump_points(files.head);
-
-	if (cd_to != -1 && fchdir(cd_to) == -1) {
-		perror("chdir");
-		exit(2);
+	if (verbose > 3 && !spill_dir)
+		dump_points(gpx_files.head);
+	/* only the tiles can make room */
+	if (memory_over()) {
+		fprintf(stderr, "%ld MB loaded, over the memory limit of %ld MB, "
+			"see -s and -O\n", (memory_used + (1 << 20) - 1) >> 20,
+			memory_limit >> 20);
+		memory_warned = 1;
 	}
 
-	int z;
-
-	if (reinitialize) {
-		fprintf(stderr, "Reinitializing zoom %d - %d\n",
-			zoom_min, zoom_max);
-		for (z = zoom_min; z <= zoom_max; ++z)
-			remove_tiles(z);
-	}
+	prepare_drawing();
 	if (!points_cnt)
 		exit(0);
-
-	prepare_zoom_levels();
+	start_png_writers(parallel);
 	clock_gettime(CLOCK_MONOTONIC, &start);
 	if (parallel == 1) {
-		for (z = zoom_min; z <= zoom_max; ++z) {
+		if (one_pass) {
+			int zooms[ZOOM_MAX + 1];
+
+			for (z = zoom_draw; z <= zoom_max; ++z)
+				zooms[z - zoom_draw] = z;
+			draw_zooms(zooms, zoom_max - zoom_draw + 1);
+		}
+		for (z = zoom_draw; z <= zoom_max; ++z) {
 			printf("z %d ", z); fflush(stdout);
-			make_tiles(files.head, z);
+			if (!one_pass)
+				draw_zooms(&z, 1);
 			printf("(%d tiles, dx %f dy %f)%s",
 			       zoom_levels[z].tile_cnt,
 			       zoom_levels[z].xunit, zoom_levels[z].yunit,
 			       verbose > 1 ? "\n" : "");
 			fflush(stdout);
+			if (z == zoom_draw && z > zoom_min) {
+				putchar('\n');
+				make_pyramid(z);
+			}
 			if (verbose > 3)
 				dump_zoom_level(z);
 			save_zoom_level(z);
@@ -1170,58 +2703,45 @@ int main(int argc, char *argv[])
 				printf(" ... saved\n");
 		}
 	} else {
-		int order[ZOOM_MAX + 1];
-		int zooms = zoom_max - zoom_min + 1;
-		struct tile_proc *tp, *tproc;
-		int a = zoom_min, b = zoom_max;
+		struct tile_worker *workers;
+		int threads;
 
-		for (z = zoom_min; z <= zoom_max; ++z)
-			order[z] = z & 1 ? b-- : a++;
-		parallel = min(parallel, zooms);
-		tproc = calloc(parallel, sizeof(*tproc));
-		for (tp = tproc, z = zoom_min; z <= zoom_max; ++tp) {
-			int err;
-
-			tp->order = order;
-			tp->start = z;
-			tp->end = z + zooms / parallel;
-			if (tp - tproc == parallel - 1)
-				tp->end = zoom_max + 1;
-			tp->files = files.head;
-			//printf("%d z %d(%d)\n", (int)(tp - tproc),
-			//       tp->start, tp->end - tp->start);
-			err = pthread_create(&tp->thr, NULL, tile_processor, tp);
-			if (err) {
-				fprintf(stderr, "z %d: pthread_create: %s (%d)\n",
-					z, strerror(err), err);
-				break;
-			}
-			z = tp->end;
-		}
-		while (tp-- > tproc) {
-			int err = pthread_join(tp->thr, NULL);
-			if (err) {
-				fprintf(stderr, "pthread_join: %s (%d)\n",
-					strerror(err), err);
+		for (gf = gpx_files.head; gf; gf = gf->next) {
+			for (z = zoom_draw; z <= zoom_max; ++z) {
+				est_points[z] += gf->points[z];
+				est_tiles[z] += gf->tiles[z];
 			}
+			est_line_len += gf->line_len;
 		}
-		free(tproc);
+		make_tile_jobs(parallel);
+		threads = min((int)parallel, tile_jobs_cnt);
+		workers = start_tile_workers(&threads);
+		if (!threads)
+			tile_processor(workers);
+		join_tile_workers(workers, threads, start);
 	}
+	join_png_writers();
 	clock_gettime(CLOCK_MONOTONIC, &end);
 	duration = timespec_sub(end, start);
 	fprintf(stderr, "z %d-%d processed in %ld.%09ld\n",
 		zoom_min, zoom_max, duration.tv_sec, duration.tv_nsec);
-	while (files.head) {
-		gf = slist_pop(&files);
-		gpx_free(gf->gpx);
+out:
+	write_tiles_format();
+	if (verbose > 0)
+		fprintf(stderr, "memory peak %ld MB\n", memory_peak >> 20);
+	while (gpx_files.head) {
+		gf = slist_pop(&gpx_files);
+		if (gf->gpx)
+			gpx_free(gf->gpx);
 		free(gf);
 	}
+	for (z = 0; z <= ZOOM_MAX; ++z)
+		gpx_spill_free(spills[z]);
 	free(zoom_levels);
 	while (free_tiles.head) {
 		struct tile *t = slist_stack_pop(&free_tiles);
 
-		if (t->img)
-			gdImageDestroy(t->img);
+		free(t->ops);
 		free(t);
 	}
 	gpx_libxml_cleanup();
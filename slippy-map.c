@@ -0,0 +1,129 @@
+#include <stdint.h>
+#include <string.h>
+#include "slippy-map.h"
+
+/*
+ * The batch projection works on 4 points at a time with the vector
+ * extensions of GCC, and without libm: lat2mercy() is atanh(sin(lat)),
+ * whose sin() and log() are evaluated with their series, exact to the
+ * double precision on the range of the Mercator latitudes. On x86-64 the
+ * clone for AVX2 or for SSE2 is selected at load time.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define MERC_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define MERC_CLONES
+#endif
+
+#define MERC_LANES (4)
+
+typedef double vdouble __attribute__((vector_size(MERC_LANES * 8)));
+typedef int64_t vint __attribute__((vector_size(MERC_LANES * 8)));
+
+#define MERC_LN2 (0.69314718055994530942)
+#define MERC_SQRT2 (1.41421356237309504880)
+/* adding it to a double in [0, 2^51) rounds it to an integer in the mantissa */
+#define MERC_ROUND (6755399441055744.0) /* 1.5 * 2^52 */
+
+static inline vdouble vselect(vint mask, vdouble a, vdouble b)
+{
+	return (vdouble)(((vint)a & mask) | ((vint)b & ~mask));
+}
+
+/* |x| <= pi/2, the last term is below 1e-18 */
+static inline vdouble merc_sin(vdouble x)
+{
+	vdouble x2 = x * x;
+	vdouble s = x2 * (1.0 / 51090942171709440000.0); /* 1/21! */
+
+	s = x2 * (-1.0 / 121645100408832000.0 + s);
+	s = x2 * (1.0 / 355687428096000.0 + s);
+	s = x2 * (-1.0 / 1307674368000.0 + s);
+	s = x2 * (1.0 / 6227020800.0 + s);
+	s = x2 * (-1.0 / 39916800.0 + s);
+	s = x2 * (1.0 / 362880.0 + s);
+	s = x2 * (-1.0 / 5040.0 + s);
+	s = x2 * (1.0 / 120.0 + s);
+	s = x2 * (-1.0 / 6.0 + s);
+	return x * (1.0 + s);
+}
+
+/* x >= 0, log(0) and log(inf) are about -+709 */
+static inline vdouble merc_log(vdouble x)
+{
+	vint bits = (vint)x;
+	vint e = (bits >> 52) - 1023;
+	vdouble m, t, t2, l;
+	vint big;
+
+	m = (vdouble)((bits & 0x000fffffffffffffll) | 0x3ff0000000000000ll);
+	/* m in [sqrt(2)/2, sqrt(2)], so that |t| <= 0.172 */
+	big = m > MERC_SQRT2;
+	e -= big;
+	m = vselect(big, m * 0.5, m);
+	t = (m - 1.0) / (m + 1.0);
+	t2 = t * t;
+	/* 2 atanh(t) */
+	l = t2 * (1.0 / 19);
+	l = t2 * (1.0 / 17 + l);
+	l = t2 * (1.0 / 15 + l);
+	l = t2 * (1.0 / 13 + l);
+	l = t2 * (1.0 / 11 + l);
+	l = t2 * (1.0 / 9 + l);
+	l = t2 * (1.0 / 7 + l);
+	l = t2 * (1.0 / 5 + l);
+	l = t2 * (1.0 / 3 + l);
+	/* e is small: added to the bits of MERC_ROUND, it becomes a double */
+	m = (vdouble)(e + (vint)((vdouble){ 0 } + MERC_ROUND)) - MERC_ROUND;
+	return m * MERC_LN2 + 2.0 * t * (1.0 + l);
+}
+
+/* merc_clamp() */
+static inline vint merc_fix(vdouble v)
+{
+	vdouble r;
+	vint n;
+
+	v *= 4294967296.0;
+	v = vselect(v < 0.0, (vdouble){ 0 }, v);
+	v = vselect(v > 4294967295.0, (vdouble){ 0 } + 4294967295.0, v);
+	r = v + MERC_ROUND;
+	n = (vint)r - (vint)((vdouble){ 0 } + MERC_ROUND);
+	/* rounded to the nearest, down to the floor */
+	return n + ((r - MERC_ROUND) > v);
+}
+
+static inline void merc_project4(struct merc *m, const double *latlon)
+{
+	vdouble lat = { latlon[0], latlon[2], latlon[4], latlon[6] };
+	vdouble lon = { latlon[1], latlon[3], latlon[5], latlon[7] };
+	vdouble s, y;
+	vint mx, my;
+	int i;
+
+	/* beyond MERC_MAX_LAT, y is clamped by merc_fix() */
+	s = merc_sin(lat * (M_PI / 180.0));
+	y = 0.5 * merc_log((1.0 + s) / (1.0 - s));
+	mx = merc_fix((lon + 180.0) / 360.0);
+	my = merc_fix((1.0 - y / M_PI) / 2.0);
+	for (i = 0; i < MERC_LANES; ++i) {
+		m[i].x = mx[i];
+		m[i].y = my[i];
+	}
+}
+
+MERC_CLONES
+void merc_project(struct merc *m, const double *latlon, int n)
+{
+	double rest[2 * MERC_LANES] = { 0 };
+	struct merc mrest[MERC_LANES];
+	int i;
+
+	for (i = 0; i + MERC_LANES <= n; i += MERC_LANES)
+		merc_project4(m + i, latlon + 2 * i);
+	if (i == n)
+		return;
+	memcpy(rest, latlon + 2 * i, 2 * (n - i) * sizeof(*rest));
+	merc_project4(mrest, rest);
+	memcpy(m + i, mrest, (n - i) * sizeof(*m));
+}
@@ -5,6 +5,7 @@
 #ifndef _SLIPPY_MAP_H_
 #define _SLIPPY_MAP_H_
 
+#include <stdint.h>
 #include <math.h>
 
 static inline int long2tilex(double lon, int z)
@@ -31,4 +32,59 @@ static inline double tiley2lat(int y, int z)
 	return 180.0 / M_PI * atan(0.5 * (exp(n) - exp(-n)));
 }
 
+/*
+ * Web Mercator coordinates of the whole world normalized to 32 bits, so
+ * that the tile of a point at zoom z is merc >> (32 - z), and its pixel in
+ * the 256x256 tile the next 8 bits.
+ */
+struct merc
+{
+	uint32_t x, y;
+};
+
+#define MERC_MAX_LAT (85.05112877980659)
+
+static inline uint32_t merc_clamp(double v)
+{
+	v = floor(v * 4294967296.0);
+	if (v < 0.0)
+		return 0;
+	if (v > 4294967295.0)
+		return UINT32_MAX;
+	return (uint32_t)v;
+}
+
+static inline uint32_t long2mercx(double lon)
+{
+	return merc_clamp((lon + 180.0) / 360.0);
+}
+
+static inline uint32_t lat2mercy(double lat)
+{
+	double lrad;
+
+	if (lat > MERC_MAX_LAT)
+		lat = MERC_MAX_LAT;
+	else if (lat < -MERC_MAX_LAT)
+		lat = -MERC_MAX_LAT;
+	lrad = lat * M_PI / 180.0;
+	return merc_clamp((1.0 - log(tan(lrad) + 1.0 / cos(lrad)) / M_PI) / 2.0);
+}
+
+static inline int merc2tile(uint32_t m, int z)
+{
+	return (uint64_t)m >> (32 - z);
+}
+
+static inline int merc2pixel(uint32_t m, int z)
+{
+	return (uint32_t)((uint64_t)m << z) >> 24;
+}
+
+/*
+ * long2mercx() and lat2mercy() of n pairs of latitude and longitude, in
+ * the vector units of the CPU. The results are within one unit of theirs.
+ */
+void merc_project(struct merc *m, const double *latlon, int n);
+
 #endif
@@ -25,6 +25,15 @@
 	*__tail = i; \
 } while(0)
 
+/* moves the items of other to the end of list */
+#define slist_splice(list, other) do { \
+	if (!slist_empty(other)) { \
+		*(list)->tail = (other)->head; \
+		(list)->tail = (other)->tail; \
+		slist_init(other); \
+	} \
+} while(0)
+
 #define slist_push(list, i) do { \
 	(i)->next = (list)->head; \
 	(list)->head = (i); \
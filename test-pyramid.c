@@ -0,0 +1,104 @@
+/*
+ * Checks that the heatmap tiles reduced from the zoom of pyramid_zoom() have
+ * the hits of those drawn directly, see "make check".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* for reduce_tile() and the drawing of the points */
+#define main gpx2tiles_main
+#include "gpx2tiles.c"
+#undef main
+
+#define TEST_POINTS (20000)
+
+static struct tile *test_tile(const struct xy *xy)
+{
+	struct tile *tile = calloc(1, sizeof(*tile));
+
+	tile->xy = *xy;
+	tile->img = gdImageCreateTrueColor(TILE_W, TILE_H);
+	tile->hits = calloc(TILE_W * TILE_H, sizeof(*tile->hits));
+	return tile;
+}
+
+static void test_free_tile(struct tile *tile)
+{
+	gdImageDestroy(tile->img);
+	free(tile->hits);
+	free(tile);
+}
+
+static void draw_heat(struct tile *tile, const struct merc *m, int z)
+{
+	struct xy pix = getPixelPosForCoordinates(m, z);
+
+	exec_tile_op(tile, &(struct tile_op){
+		.op = TILE_OP_HEAT, .color = heatmapclr,
+		.x1 = pix.x, .y1 = pix.y,
+		.x2 = z >= z_heatmap_bigdots });
+}
+
+/* the points on the tile at, at z - 1, drawn at z and z - 1 */
+static int test_reduce(const struct xy *at, int z)
+{
+	struct tile *parent = test_tile(at), *direct = test_tile(at);
+	struct tile *children[4];
+	int i, diffs = 0;
+
+	for (i = 0; i < 4; ++i) {
+		struct xy xy = { 2 * at->x + (i & 1), 2 * at->y + (i >> 1) };
+
+		children[i] = test_tile(&xy);
+	}
+	for (i = 0; i < TEST_POINTS; ++i) {
+		/* the merc coordinates of the tile at, at z - 1 */
+		const int shift = 32 - (z - 1);
+		struct merc m = {
+			.x = ((uint32_t)at->x << shift) + (lrand48() & ((1u << shift) - 1)),
+			.y = ((uint32_t)at->y << shift) + (lrand48() & ((1u << shift) - 1)),
+		};
+		struct xy xy = get_tile_xy(&m, z);
+
+		draw_heat(children[(xy.x & 1) + 2 * (xy.y & 1)], &m, z);
+		draw_heat(direct, &m, z - 1);
+	}
+	for (i = 0; i < 4; ++i) {
+		reduce_tile(parent, children[i]);
+		test_free_tile(children[i]);
+	}
+	for (i = 0; i < TILE_W * TILE_H; ++i)
+		diffs += parent->hits[i] != direct->hits[i];
+	test_free_tile(parent);
+	test_free_tile(direct);
+	return diffs;
+}
+
+int main(void)
+{
+	static const int zoom_maxes[] = { 12, 14, 16, 18 };
+	const struct xy at = { 100, 200 };
+	int failures = 0, diffs, z;
+	unsigned i;
+
+	srand48(1);
+	pyramid = 1;
+	z_no_lines = HEATMAP_MODE;
+	zoom_min = 1;
+	for (i = 0; i < countof(zoom_maxes); ++i) {
+		zoom_max = zoom_maxes[i];
+		z = pyramid_zoom();
+		diffs = test_reduce(&at, z);
+		if (diffs) {
+			fprintf(stderr, "-Z %d: %d pixels of z %d reduced from z %d differ\n",
+				zoom_max, diffs, z - 1, z);
+			failures++;
+		}
+	}
+	if (failures) {
+		fprintf(stderr, "test-pyramid: %d failures\n", failures);
+		return 1;
+	}
+	printf("test-pyramid: ok\n");
+	return 0;
+}
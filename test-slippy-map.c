@@ -0,0 +1,253 @@
+/*
+ * Checks the Web Mercator coordinates of slippy-map.h against the tile
+ * numbers of long2tilex() and lat2tiley(), and every clone of
+ * merc_project() against them, see "make check".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+/* for its clones of merc_project(), which are local to it */
+#include "slippy-map.c"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+void merc_project_avx2(struct merc *m, const double *latlon, int n)
+	__asm__("merc_project.avx2");
+void merc_project_default(struct merc *m, const double *latlon, int n)
+	__asm__("merc_project.default");
+
+static int has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static int has_cpu(void)
+{
+	return 1;
+}
+
+static const struct kernel
+{
+	const char *name;
+	void (*project)(struct merc *m, const double *latlon, int n);
+	int (*supported)(void);
+} kernels[] = {
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+	{ "avx2", merc_project_avx2, has_avx2 },
+	{ "default", merc_project_default, has_cpu },
+#else
+	{ "merc_project", merc_project, has_cpu },
+#endif
+};
+
+#define TEST_POINTS (200000)
+#define TEST_ZOOM_MAX (18)
+#define countof(a) (sizeof(a) / sizeof((a)[0]))
+
+static int failures;
+
+static void fail(const char *what, double v, int z, long got, long want)
+{
+	if (failures++ < 20)
+		fprintf(stderr, "%s(%.17g) at z %d: %ld instead of %ld\n",
+			what, v, z, got, want);
+}
+
+/* the position in the world, in [0, 1], as computed by lat2tiley() */
+static double lat2world(double lat)
+{
+	double lrad = lat * M_PI / 180.0;
+
+	return (1.0 - log(tan(lrad) + 1.0 / cos(lrad)) / M_PI) / 2.0;
+}
+
+static double lon2world(double lon)
+{
+	return (lon + 180.0) / 360.0;
+}
+
+/* the tile and the pixel in it of a position in the world, at zoom z */
+static void world2tile(double w, int z, long *tile, long *pixel)
+{
+	const long last = (1l << z) - 1;
+	double p = floor(ldexp(w, z + 8));
+
+	*tile = (long)floor(ldexp(w, z));
+	*pixel = (long)p - (*tile << 8);
+	if (*tile < 0) {
+		*tile = 0;
+		*pixel = 0;
+	} else if (*tile > last) {
+		*tile = last;
+		*pixel = 255;
+	}
+}
+
+static void check(const char *what, double v, uint32_t m, double w,
+		  int (*tile)(double, int))
+{
+	long want, want_pixel;
+	int z;
+
+	for (z = 0; z <= TEST_ZOOM_MAX; ++z) {
+		world2tile(w, z, &want, &want_pixel);
+		if (merc2tile(m, z) != want)
+			fail(what, v, z, merc2tile(m, z), want);
+		else if (merc2pixel(m, z) != want_pixel)
+			fail(what, v, z, merc2pixel(m, z), want_pixel);
+		/* where it is defined, the tile of slippy-map.h itself */
+		if (tile && tile(v, z) >= 0 && tile(v, z) < (1l << z) &&
+		    tile(v, z) != want)
+			fail(what, v, z, want, tile(v, z));
+	}
+}
+
+static void check_lat(double lat)
+{
+	check("lat2mercy", lat, lat2mercy(lat), lat2world(lat), lat2tiley);
+}
+
+static void check_lon(double lon)
+{
+	check("long2mercx", lon, long2mercx(lon), lon2world(lon), long2tilex);
+}
+
+/* beyond MERC_MAX_LAT, the points are on the edge of the map */
+static void check_clamp(double lat)
+{
+	const uint32_t edge = lat2mercy(lat > 0 ? MERC_MAX_LAT : -MERC_MAX_LAT);
+	int z;
+
+	if (lat2mercy(lat) != edge)
+		fail("lat2mercy", lat, 32, lat2mercy(lat), edge);
+	for (z = 0; z <= TEST_ZOOM_MAX; ++z) {
+		const long want = lat > 0 ? 0 : (1l << z) - 1;
+
+		if (merc2tile(lat2mercy(lat), z) != want)
+			fail("lat2mercy", lat, z, merc2tile(lat2mercy(lat), z), want);
+	}
+}
+
+/* the batches differ from long2mercx() and lat2mercy() by at most 1 */
+#define KERNEL_MAX_ERROR (1)
+
+static unsigned kernel_error(uint32_t got, uint32_t want)
+{
+	return got > want ? got - want : want - got;
+}
+
+static void kernel_fail(const struct kernel *k, const char *what,
+			const double *latlon, long got, long want)
+{
+	if (failures++ < 20)
+		fprintf(stderr, "%s: %s of (%.17g, %.17g): %ld instead of %ld\n",
+			k->name, what, latlon[0], latlon[1], got, want);
+}
+
+static void check_kernel(const struct kernel *k, const double *latlon, int n)
+{
+	struct merc *m = malloc(n * sizeof(*m));
+	unsigned err, max_err = 0;
+	int i, len;
+
+	k->project(m, latlon, n);
+	for (i = 0; i < n; ++i) {
+		const double *p = latlon + 2 * i;
+
+		err = kernel_error(m[i].x, long2mercx(p[1]));
+		if (err > KERNEL_MAX_ERROR)
+			kernel_fail(k, "x", p, m[i].x, long2mercx(p[1]));
+		if (max_err < err)
+			max_err = err;
+		err = kernel_error(m[i].y, lat2mercy(p[0]));
+		if (err > KERNEL_MAX_ERROR)
+			kernel_fail(k, "y", p, m[i].y, lat2mercy(p[0]));
+		if (max_err < err)
+			max_err = err;
+	}
+	/* the points after the last batch of MERC_LANES */
+	for (len = 1; len < MERC_LANES && len <= n; ++len) {
+		struct merc tail[MERC_LANES];
+
+		k->project(tail, latlon, len);
+		for (i = 0; i < len; ++i) {
+			if (tail[i].x != m[i].x)
+				kernel_fail(k, "tail x", latlon + 2 * i,
+					    tail[i].x, m[i].x);
+			if (tail[i].y != m[i].y)
+				kernel_fail(k, "tail y", latlon + 2 * i,
+					    tail[i].y, m[i].y);
+		}
+	}
+	printf("test-slippy-map: %s: %d points within %u\n", k->name, n, max_err);
+	free(m);
+}
+
+static void check_kernels(void)
+{
+	static const double lats[] = {
+		0.0, MERC_MAX_LAT, -MERC_MAX_LAT, 85.0511, -85.0511, 89.9, -89.9,
+		90.0, -90.0, 1e-9, -1e-9,
+	};
+	static const double lons[] = {
+		0.0, 180.0, -180.0, 179.9999999, -179.9999999, 1e-9, -1e-9,
+	};
+	const int edges = countof(lats) * countof(lons);
+	const int n = edges + TEST_POINTS + 3;
+	double *latlon = malloc(2 * n * sizeof(*latlon));
+	size_t i;
+	int j;
+
+	for (j = 0; j < edges; ++j) {
+		latlon[2 * j] = lats[j / countof(lons)];
+		latlon[2 * j + 1] = lons[j % countof(lons)];
+	}
+	srand48(2);
+	for (; j < n; ++j) {
+		latlon[2 * j] = (2.0 * drand48() - 1.0) * MERC_MAX_LAT;
+		latlon[2 * j + 1] = 360.0 * drand48() - 180.0;
+	}
+	for (i = 0; i < countof(kernels); ++i)
+		if (kernels[i].supported())
+			check_kernel(kernels + i, latlon, n);
+		else
+			printf("test-slippy-map: %s: not supported by the CPU\n",
+			       kernels[i].name);
+	free(latlon);
+}
+
+int main(void)
+{
+	static const double lats[] = {
+		0.0, MERC_MAX_LAT, -MERC_MAX_LAT, 85.0511, -85.0511, 45.0, -45.0,
+		1e-9, -1e-9,
+	};
+	static const double lons[] = {
+		0.0, 180.0, -180.0, 179.9999999, -179.9999999, 90.0, -90.0,
+		1e-9, -1e-9, 200.0, -200.0,
+	};
+	static const double beyond[] = {
+		85.06, -85.06, 89.0, -89.0, 90.0, -90.0,
+	};
+	size_t i;
+
+	for (i = 0; i < countof(lats); ++i)
+		check_lat(lats[i]);
+	for (i = 0; i < countof(lons); ++i)
+		check_lon(lons[i]);
+	for (i = 0; i < countof(beyond); ++i)
+		check_clamp(beyond[i]);
+	srand48(1);
+	for (i = 0; i < TEST_POINTS; ++i) {
+		check_lat((2.0 * drand48() - 1.0) * MERC_MAX_LAT);
+		check_lon(360.0 * drand48() - 180.0);
+	}
+	check_kernels();
+	if (failures) {
+		fprintf(stderr, "test-slippy-map: %d failures\n", failures);
+		return 1;
+	}
+	printf("test-slippy-map: ok\n");
+	return 0;
+}
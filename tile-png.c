@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <zlib.h>
+#include "tile-png.h"
+
+/*
+ * The tiles have a transparent background and a few colors of the speeds,
+ * so most of them fit in a palette of 1, 2 or 4 bits per pixel. Their rows
+ * are not filtered: the differences of the indexes mean nothing, and the
+ * empty rows are already runs of zeros.
+ */
+#define TILE_PNG_COLORS (256)
+#define TILE_PNG_HASH_BITS (9u)
+
+int tile_png_level = 4, tile_png_strategy = Z_RLE;
+
+struct png_palette
+{
+	int cnt;
+	uint32_t rgb[TILE_PNG_COLORS];
+	/* of the hash of the colors, their index + 1, 0 if free */
+	uint16_t slots[1u << TILE_PNG_HASH_BITS];
+};
+
+/* -1 if the palette is full */
+static int palette_index(struct png_palette *p, uint32_t rgb)
+{
+	const unsigned mask = (1u << TILE_PNG_HASH_BITS) - 1;
+	unsigned i = (rgb * 0x9e3779b1u) >> (32 - TILE_PNG_HASH_BITS);
+
+	for (; p->slots[i]; i = (i + 1) & mask)
+		if (p->rgb[p->slots[i] - 1] == rgb)
+			return p->slots[i] - 1;
+	if (p->cnt == TILE_PNG_COLORS)
+		return -1;
+	p->rgb[p->cnt] = rgb;
+	p->slots[i] = ++p->cnt;
+	return p->cnt - 1;
+}
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int write_chunk(FILE *fp, const char *type, const unsigned char *data,
+		       uint32_t len)
+{
+	unsigned char b[4];
+	uLong crc = crc32(0, (const Bytef *)type, 4);
+
+	if (len)
+		crc = crc32(crc, data, len);
+	put_be32(b, len);
+	if (fwrite(b, 1, 4, fp) != 4 || fwrite(type, 1, 4, fp) != 4 ||
+	    (len && fwrite(data, 1, len, fp) != len))
+		return -1;
+	put_be32(b, crc);
+	return fwrite(b, 1, 4, fp) == 4 ? 0 : -1;
+}
+
+/* the rows of the indexes, packed */
+static unsigned char *pack_rows(const unsigned char *idx, int w, int h,
+				  int depth, size_t *size)
+{
+	const size_t stride = ((size_t)w * depth + 7) / 8;
+	unsigned char *raw, *row;
+	int x, y;
+
+	raw = calloc(h, stride + 1);
+	if (!raw)
+		return NULL;
+	for (y = 0; y < h; ++y) {
+		row = raw + y * (stride + 1);
+		/* with the filter none, 0 */
+		for (x = 0; x < w; ++x) {
+			const int bit = x * depth;
+
+			row[1 + bit / 8] |= idx[y * w + x] << (8 - depth - bit % 8);
+		}
+	}
+	*size = h * (stride + 1);
+	return raw;
+}
+
+static unsigned char *deflate_rows(const unsigned char *raw, size_t size,
+				   size_t *zsize)
+{
+	z_stream zs = { 0 };
+	unsigned char *out;
+
+	if (deflateInit2(&zs, tile_png_level, Z_DEFLATED, 15, 8,
+			 tile_png_strategy) != Z_OK)
+		return NULL;
+	*zsize = deflateBound(&zs, size);
+	out = malloc(*zsize);
+	zs.next_in = (Bytef *)raw;
+	zs.avail_in = size;
+	zs.next_out = out;
+	zs.avail_out = *zsize;
+	if (!out || deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(out);
+		return NULL;
+	}
+	*zsize = zs.total_out;
+	deflateEnd(&zs);
+	return out;
+}
+
+int tile_png_write(gdImage *img, FILE *fp)
+{
+	static const unsigned char signature[8] = {
+		0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+	};
+	const int w = gdImageSX(img), h = gdImageSY(img);
+	const int transparent = gdImageGetTransparent(img);
+	const unsigned char trns[1] = { 0 };
+	unsigned char ihdr[13], plte[3 * TILE_PNG_COLORS];
+	unsigned char *idx, *raw = NULL, *z = NULL;
+	struct png_palette *pal;
+	size_t size, zsize;
+	int x, y, i, depth, err = 1;
+
+	if (!gdImageTrueColor(img))
+		return 1;
+	pal = calloc(1, sizeof(*pal));
+	idx = malloc((size_t)w * h);
+	if (!pal || !idx)
+		goto out;
+	/* the transparent color is the first one */
+	if (transparent >= 0)
+		palette_index(pal, transparent & 0xffffff);
+	for (y = 0; y < h; ++y)
+		for (x = 0; x < w; ++x) {
+			i = palette_index(pal,
+					  gdImageTrueColorPixel(img, x, y) & 0xffffff);
+			if (i < 0)
+				goto out;
+			idx[y * w + x] = i;
+		}
+	depth = pal->cnt <= 2 ? 1 : pal->cnt <= 4 ? 2 : pal->cnt <= 16 ? 4 : 8;
+	raw = pack_rows(idx, w, h, depth, &size);
+	if (!raw || !(z = deflate_rows(raw, size, &zsize)))
+		goto out;
+
+	/* the errors from here are those of the writes */
+	err = -1;
+	put_be32(ihdr, w);
+	put_be32(ihdr + 4, h);
+	ihdr[8] = depth;
+	ihdr[9] = 3; /* indexed */
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	for (i = 0; i < pal->cnt; ++i) {
+		plte[3 * i] = pal->rgb[i] >> 16;
+		plte[3 * i + 1] = pal->rgb[i] >> 8;
+		plte[3 * i + 2] = pal->rgb[i];
+	}
+	if (fwrite(signature, 1, sizeof(signature), fp) != sizeof(signature) ||
+	    write_chunk(fp, "IHDR", ihdr, sizeof(ihdr)) ||
+	    write_chunk(fp, "PLTE", plte, 3 * pal->cnt) ||
+	    (transparent >= 0 && write_chunk(fp, "tRNS", trns, sizeof(trns))) ||
+	    write_chunk(fp, "IDAT", z, zsize) ||
+	    write_chunk(fp, "IEND", NULL, 0))
+		goto out;
+	err = 0;
+out:
+	free(z);
+	free(raw);
+	free(idx);
+	free(pal);
+	return err;
+}
+
+gdImage *tile_png_truecolor(gdImage *img)
+{
+	gdImage *tc;
+	int x, y;
+
+	if (gdImageTrueColor(img))
+		return img;
+	tc = gdImageCreateTrueColor(gdImageSX(img), gdImageSY(img));
+	if (tc)
+		for (y = 0; y < gdImageSY(img); ++y)
+			for (x = 0; x < gdImageSX(img); ++x) {
+				const int c = gdImagePalettePixel(img, x, y);
+
+				gdImageTrueColorPixel(tc, x, y) =
+					gdTrueColor(gdImageRed(img, c),
+						    gdImageGreen(img, c),
+						    gdImageBlue(img, c));
+			}
+	gdImageDestroy(img);
+	return tc;
+}
@@ -0,0 +1,25 @@
+#ifndef _TILE_PNG_H_
+#define _TILE_PNG_H_
+
+#include <stdio.h>
+#include <gd.h>
+
+/*
+ * The tiles are written as gdImagePngEx() does with a true color image
+ * without saveAlpha: their RGB, with the transparent color in tRNS. Those
+ * with at most 256 colors are written as indexed PNGs instead.
+ */
+
+/* of zlib, 4 and Z_RLE by default */
+extern int tile_png_level, tile_png_strategy;
+
+/*
+ * 0 if written, 1 if not (too many colors, or out of memory) and -1 if the
+ * write failed
+ */
+int tile_png_write(gdImage *img, FILE *fp);
+
+/* an indexed PNG read back as the true color image it was written from */
+gdImage *tile_png_truecolor(gdImage *img);
+
+#endif /* _TILE_PNG_H_ */